@@ -32,6 +32,18 @@
 
 #include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <spawn.h>
+#ifdef __linux__
+# include <sys/epoll.h>
+#endif
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+# define ZP_X86_SIMD 1
+# include <immintrin.h>
+#endif
 
 static HashTable my_newparamtable(int size, char const *name);
 static HashTable my_newhashtable(int size, UNUSED(char const *name), UNUSED(PrintTableStats printinfo));
@@ -56,14 +68,141 @@ static void my_assigngetset(Param pm);
 static char * my_strgetfn(Param pm);
 static void my_strsetfn(Param pm, char *x);
 static void my_stdunsetfn(Param pm, UNUSED(int exp));
+static void zptable_strsetfn(Param pm, char *x);
+static char * zptable_lazygetfn(Param pm);
+static char * zptable_lazyncgetfn(Param pm);
+static const struct gsu_scalar zptable_scalar_gsu;
+static const struct gsu_scalar zptable_heapval_gsu;
+static const struct gsu_scalar zptable_lazy_gsu;
+static const struct gsu_scalar zptable_lazync_gsu;
+
+static HashTable my_allochashtable(size_t tabsize, int size, UNUSED(char const *name), UNUSED(PrintTableStats printinfo));
+static void zptable_emptytable(HashTable ht);
+static void zptable_addnode(HashTable ht, char *nam, void *nodeptr);
+static HashNode zptable_removenode(HashTable ht, const char *nam);
+static void zptable_freenode(HashNode hn);
 
 /* }}} */
 
+/* Memory carved in order from large chunks, released
+ * all at once */
+struct arenachunk {
+    struct arenachunk *next;
+    size_t size;
+    size_t used;
+};
+
+struct arena {
+    struct arenachunk *chunks;
+    size_t next_size;
+    /* Total size of chunks, for -M */
+    size_t bytes;
+};
+
+/* Input mapping that values of a table point into */
+struct zpmap {
+    struct zpmap *next;
+    void *data;
+    size_t len;
+};
+
+/* Hash table created by this module. Param nodes, keys
+ * and values stored by worker come from `arena'. Shell
+ * can still add its own nodes and values - these are
+ * counted, and when there are none, emptying the table
+ * doesn't have to visit the nodes */
+struct zptable {
+    struct hashtable ht;
+    struct arena arena;
+    int foreign;
+    int heapvals;
+    /* Linear hashing: ht.hsize == level + split buckets
+     * are in use, out of `cap' allocated; a bucket below
+     * `split' has already been divided with level+bucket */
+    int level;
+    int split;
+    int cap;
+    /* Mappings retained for lazy values, see -l */
+    struct zpmap *maps;
+};
+
+/* Param node allocated from table's arena. It is told
+ * apart from other nodes by its gsu, see ZPNODE_P() */
+struct zpparam {
+    struct param pm;
+    struct zptable *table;
+    /* Full hash of node.nam, compared before the name */
+    unsigned hashval;
+    /* Lazy value: pm.u.str points into a mapping, to
+     * `vlen' unmetafied bytes */
+    int vlen;
+};
+
+static void arena_init(struct arena *a);
+static void *arena_alloc(struct arena *a, size_t size, size_t align);
+static void arena_release(struct arena *a);
+static void arena_adopt(struct arena *dst, struct arena *src);
+static char *arena_metafy_dup(struct arena *a, const char *s, int len);
+static struct zpparam *zptable_newnode(struct zptable *zt, const char *mkey, int mkey_len, unsigned hashval, const char *value, int value_len);
+static struct zpparam *zptable_lookup(struct zptable *zt, const char *nam, unsigned hashval);
+static void zptable_insert(struct zptable *zt, struct zpparam *node);
+static unsigned zp_hash(const char *str);
+static unsigned zp_memhash(const char *s, size_t len);
+static void zptable_setvalue(struct zpparam *node, const char *value, int value_len);
+static void zptable_setstr(struct zpparam *node, char *str);
+static void zptable_setlazy(struct zpparam *node, const char *value, int value_len, int cache);
+static void zptable_addmap(struct zptable *zt, void *data, size_t len);
+static int is_zptable(HashTable ht);
+static unsigned my_hashindex(HashTable ht, unsigned hashval);
+static void zptable_grow(struct zptable *zt);
+static void zptable_merge(struct zptable *dst, struct zptable *src);
+static void zptable_delete(HashTable ht);
+static void zpindex_emptytable(HashTable ht);
+static int is_zpindex(HashTable ht);
+
 #define OUTPUT_ARRAY 1
 #define OUTPUT_HASH 2
 #define OUTPUT_VARS 3
+#define OUTPUT_QUEUE 4
+
+/* Framing of input, -F; delimeters by default */
+#define FRAME_DELIM 0
+#define FRAME_NUL 1
+#define FRAME_NET 2
+#define FRAME_LEN 3
+#define FRAME_FIXED 4
 
-#define WORKER_COUNT 32
+/* JSON Lines input, -J */
+#define JSON_FLAT 1
+#define JSON_PATH 2
+
+/* States of worker slot */
+#define WORKER_FREE 0
+#define WORKER_RUNNING 1
+#define WORKER_FINISHED 2
+
+/* Largest worker ID, bounds the registry */
+#define WORKERS_MAX 1024
+
+/* Largest -j, and largest -q ring */
+#define JOBS_MAX 256
+#define QUEUE_MAX ( 1 << 24 )
+
+/* Whether Param is a node of struct zptable's arena */
+#define ZPNODE_P(pm) \
+    ( (pm)->gsu.s == &zptable_scalar_gsu || (pm)->gsu.s == &zptable_heapval_gsu || \
+      ZPLAZY_P(pm) )
+
+/* Whether Param's value is still in input mapping */
+#define ZPLAZY_P(pm) \
+    ( (pm)->gsu.s == &zptable_lazy_gsu || (pm)->gsu.s == &zptable_lazync_gsu )
+
+/* Number of bytes requested from input in one read() */
+#define READ_SIZE 65536
+
+/* Largest -n that sizes anything up front; tables and
+ * arrays grow past it as records come */
+#define EXPECTED_MAX ( 1 << 20 )
 
 #define ROINTPARAMDEF(name, var) \
     { name, PM_INTEGER | PM_READONLY, (void *) var, NULL,  NULL, NULL, NULL }
@@ -71,623 +210,4763 @@ static void my_stdunsetfn(Param pm, UNUSED(int exp));
 #define ROARRPARAMDEF(name, var) \
     { name, PM_ARRAY | PM_READONLY, (void *) var, NULL,  NULL, NULL, NULL }
 
+/* Unmetafied delimeter, with Horspool's shift table
+ * used when it's longer than a single byte */
+struct delimiter {
+    char *str;
+    int len;
+    int skip[ 256 ];
+};
+
+/* Member names of -J path "a.b.c", unmetafied; depth 0
+ * selects the whole object */
+struct jpath {
+    char *str;
+    char **names;
+    int *lens;
+    int depth;
+};
+
+/* Worker's buffer for decoded JSON strings */
+struct jbuf {
+    char *buf;
+    int size;
+};
+
+/* Worker-private array, grown geometrically, handed
+ * to the target parameter in one pointer store */
+struct arrbuild {
+    char **elems;
+    int count;
+    int cap;
+    /* Initial capacity hint, from -n */
+    int expected;
+};
+
+/* Node of worker's cache of -x parameters; `pm' is NULL
+ * when the variable cannot be set, so that it's not
+ * looked up again. `epoch' is outconf's `var_epoch' when
+ * `pm' was last found to be still in the shell's table */
+struct varcache {
+    struct hashnode node;
+    Param pm;
+    unsigned epoch;
+};
+
+/* Node of list of memory to be freed by main thread */
+struct retired {
+    struct retired *next;
+    void *ptr;
+    void (*freefn)( void *ptr );
+};
+
 struct outconf {
     int id;
     int mode;
     char *target;
     Param target_pm;
-    char *main_d;
-    int main_d_len;
-    char *sub_d;
-    int sub_d_len;
+    struct arrbuild arr;
+    int batch;
+    HashTable varcache;
+    /* Bumped for each batch of records; cached -x
+     * parameters are checked again in a new batch */
+    unsigned var_epoch;
+    /* With -p: worker-private table, published at end */
+    int private_hash;
+    HashTable ht;
+    /* Expected number of records, from -n */
+    int expected;
+    /* With -f, number of threads parsing the mapped file */
+    int jobs;
+    /* With -I, target becomes index over mapped input */
+    int index;
+    /* With -l or -L, values refer to retained mapping;
+     * `lazy_data' is set while such mapping is parsed */
+    int lazy;
+    int lazy_cache;
+    const char *lazy_data;
+    struct delimiter main_d;
+    struct delimiter sub_d;
+    /* With -F, how records are framed instead of main_d;
+     * for "fixed", record width and width of key, or 0 */
+    int framing;
+    int fixed_len;
+    int fixed_key;
+    /* With -J: JSON_FLAT stores members of each object,
+     * JSON_PATH values at `jkey' and `jval'; decoded key,
+     * value and member name go to `jbufs' */
+    int json;
+    struct jpath jkey;
+    struct jpath jval;
+    struct jbuf jbufs[ 3 ];
+    int json_bad;
+    char *keybuf;
+    int keybuf_size;
+    /* With -f, input file, mapped when it's regular */
+    char *file;
+    /* With -u, descriptors read instead of standard input */
+    struct source *sources;
+    int nsources;
+    /* With -M, bound of input buffer, and of private hash,
+     * 0 if none; `spill_fd' is an unlinked temporary file
+     * that takes input past the bound, or -1 */
+    long limit;
+    int spill_fd;
     FILE *stream;
+    /* Descriptor that the worker reads: of `stream', or,
+     * without a stream, one that main thread opened and
+     * registered with addmodulefd() - it's handed back to
+     * main thread for zclose(); -1 if none */
+    int in_fd;
     FILE *err;
     FILE *r_devnull;
     int silent;
     int only_global;
     int debug;
+    /* Worker's slot in registry */
+    struct worker *worker;
+    /* Main thread waits on this until the thread
+     * duplicated standard input; then it's NULL */
+    struct startup *startup;
+};
+
+static void free_sources(struct outconf *oconf, int in_worker);
+static void parse_mapping(struct outconf *oconf, void *data, size_t len);
+
+/* Timed stages of the worker loop, for -T and zpstats */
+#define STAGE_READ 0
+#define STAGE_SCAN 1
+#define STAGE_SPLIT 2
+#define STAGE_LOOKUP 3
+#define STAGE_ALLOC 4
+#define STAGE_MOVE 5
+#define STAGES 6
+
+/* Counters of a worker's run. Worker updates them with
+ * relaxed atomics, main thread reads them at any time
+ * for $zpworker_stats */
+struct workerstats {
+    long bytes;
+    long records;
+    long inserted;
+    long hiwater;
+    /* Heap allocations made by the worker's threads */
+    long allocs;
+    /* With -T: time spent in each stage, in zp_ticks()
+     * units, and number of times the stage was entered */
+    int timed;
+    long ticks[ STAGES ];
+    long calls[ STAGES ];
+    /* CLOCK_MONOTONIC nanoseconds; `end_ns' is 0 while
+     * running, `start_ns' is 0 if slot was never used */
+    int64_t start_ns;
+    int64_t end_ns;
+};
+
+#define STAT_ADD( field, n ) __atomic_fetch_add( &( field ), ( n ), __ATOMIC_RELAXED )
+#define STAT_SET( field, v ) __atomic_store_n( &( field ), ( v ), __ATOMIC_RELAXED )
+#define STAT_GET( field ) __atomic_load_n( &( field ), __ATOMIC_RELAXED )
+
+/* Stats of worker that runs current thread, NULL in main thread */
+static __thread struct workerstats *thread_stats = NULL;
+
+#define COUNT_ALLOC() \
+    do { if ( thread_stats ) STAT_ADD( thread_stats->allocs, 1 ); } while ( 0 )
+
+/* Brackets a stage with -T; costs a test when timing is off */
+#define STAGE_BEGIN( t0 ) \
+    uint64_t t0 = ( thread_stats && thread_stats->timed ) ? zp_ticks() : 0
+#define STAGE_END( stage, t0 ) \
+    do { if ( t0 ) stage_end( ( stage ), ( t0 ) ); } while ( 0 )
+
+/* Lives on main thread's stack during thread startup */
+struct startup {
     pthread_cond_t      cond;
     pthread_mutex_t     mutex;
+    int                 started;
+};
+
+/* Bounded single-producer/single-consumer ring of records,
+ * for -q. Worker owns `tail', zpread owns `head'; each is
+ * on its own cache line. Strings are metafied, on the heap,
+ * and handed over to the consumer */
+struct queue {
+    char **slots;
+    unsigned long mask;
+    unsigned long head;
+    char pad1[ 64 ];
+    unsigned long tail;
+    char pad2[ 64 ];
+    /* Worker sleeps on `cond' while the ring is full */
+    int waiting;
+    /* Set by zpread -c or module cleanup; worker stops
+     * waiting, drops further records and ends */
+    int cancelled;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /* Data pipe, worker writes to it when it makes empty
+     * ring non-empty; read end is polled by zpread */
+    int fd;
+    int wfd;
 };
 
+/* Worker slot. Slots are allocated one by one and never
+ * freed, so a thread can keep a pointer to its own slot
+ * while main thread grows the registry */
+struct worker {
+    int state;
+    pthread_t thread;
+    /* Element of $zpworker_finished, "0" or "1" */
+    char finished[ 2 ];
+    /* Readiness pipe, worker writes to it when it finishes;
+     * read end is element of $zpworker_fd, "" if none */
+    int fd;
+    int wfd;
+    char fdstr[ 12 ];
+    /* Outcome of last run, reported by zpwait */
+    int status;
+    const char *error;
+    struct workerstats stats;
+    /* With -q, records not yet taken by zpread; kept
+     * after the worker finishes, until drained */
+    struct queue *queue;
+    /* Descriptors registered with addmodulefd() that the
+     * worker is done with; main thread zclose()s them when
+     * it joins the worker */
+    int *closefds;
+    int nclosefds;
+};
+
+/* Descriptors a worker can hand back: of -u, the input
+ * of -f or -c, and the spill file */
+#define CLOSEFDS_MAX( oconf ) ( ( oconf )->nsources + 2 )
+
 struct zpinconf {
     char *command[2];
     FILE *w_devnull;
 };
 
-/* pthread data structures for all threads */
-pthread_t workers[ WORKER_COUNT ];
+/* Registry of worker slots, grows when all are busy */
+static struct worker **workers = NULL;
+static int workers_size = 0;
 
-/* Holds WORKER_COUNT designators of worker activity */
+/* Holds designators of worker activity, one per slot;
+ * strings are the slots' `finished' fields */
 char **worker_finished;
 
-/* Holds number of workers being active */
-int workers_count = 0;
+/* Holds readiness fds, one per slot; strings are
+ * the slots' `fdstr' fields */
+char **worker_fd;
 
-static
-Param ensurethereishash( char *name, struct outconf *oconf ) {
-    Param pm;
+/* Holds number of workers being active; changed by
+ * main and worker threads, so only atomically */
+int workers_count = 0;
 
-    pm = (Param) paramtab->getnode( paramtab, name );
-    if ( ! pm ) {
-        pm = createparam( name, PM_HASHED );
-        if ( ! pm ) {
-            return NULL;
-        }
-    } else {
-        if ( oconf->only_global && pm->level != 0 ) {
-            if ( ! oconf->silent ) {
-                fprintf( stderr, "Non-global variable `%s' exists, aborting (-g)\n", name );
-                fflush( stderr );
-            }
-            return NULL;
-        }
+/* Memory that shell could still reference when worker
+ * replaced it; freed by main thread, in reap_retired() */
+static struct retired *retired_list = NULL;
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-        if ( ! ( pm->node.flags & PM_HASHED ) ) {
-            if ( ! oconf->silent ) {
-                fprintf( stderr, "Variable `%s' isn't hash table, aborting\n", name );
-            }
-            return NULL;
-        }
+/* Called by worker thread */
+static void
+retire( void *ptr, void (*freefn)( void *ptr ) ) {
+    struct retired *r = (struct retired *) malloc( sizeof( struct retired ) );
+    if ( ! r ) {
+        /* Better leak than free what shell might be using */
+        return;
+    }
+    r->ptr = ptr;
+    r->freefn = freefn;
 
-        if ( oconf->debug ) {
-            if ( pm ) {
-                fprintf( stderr, "zpopulator: Reused parameter, level: %d, locallevel: %d, unset: %d, unsetfn: %p\n",
-                        pm->level, locallevel, pm->node.flags & PM_UNSET ? 1 : 0, pm->gsu.s->unsetfn );
-                if ( pm->old ) {
-                    fprintf( stderr, "zpopulator: There is pm->old, level: %d\n", pm->old->level );
-                }
-                fflush( stderr );
-            }
-        }
+    pthread_mutex_lock( &retired_mutex );
+    r->next = retired_list;
+    retired_list = r;
+    pthread_mutex_unlock( &retired_mutex );
+}
 
-        return pm;
+/* Called by main thread, when it's not inside any
+ * expansion that could use the retired memory */
+static void
+reap_retired() {
+    struct retired *r, *next;
+
+    pthread_mutex_lock( &retired_mutex );
+    r = retired_list;
+    retired_list = NULL;
+    pthread_mutex_unlock( &retired_mutex );
+
+    for ( ; r; r = next ) {
+        next = r->next;
+        r->freefn( r->ptr );
+        free( r );
     }
+}
 
-    if ( oconf->debug ) {
-        if ( pm ) {
-            fprintf( stderr, "zpopulator: Created parameter, level: %d, locallevel: %d, unset: %d, unsetfn: %p\n",
-                    pm->level, locallevel, pm->node.flags & PM_UNSET ? 1 : 0, pm->gsu.s->unsetfn );
-            if ( pm->old ) {
-                fprintf( stderr, "zpopulator: There is pm->old, level: %d\n", pm->old->level );
-            }
-            fflush( stderr );
-        }
-    }
+static void
+retired_freearray( void *ptr ) {
+    freearray( (char **) ptr );
+}
 
-    /* This creates standard hash. However, it normally
-     * had getparamnode() call in getnode field, with
-     * PM_AUTOLOAD features - this is disabled here */
-    pm->u.hash = my_newparamtable( 32, name );
-    if ( ! pm->u.hash ) {
-        paramtab->removenode( paramtab, name );
-        paramtab->freenode( &pm->node );
-        if ( ! oconf->silent ) {
-            fprintf( stderr, "zpopulator: Out of memory when allocating hash\n" );
-        }
-    }
+static void
+retired_free( void *ptr ) {
+    free( ptr );
+}
 
-    return pm;
+static void
+retired_deleteparamtable( void *ptr ) {
+    deleteparamtable( (HashTable) ptr );
 }
 
-static
-void set_in_hash( struct outconf *oconf, const char *key, const char *value ) {
-    if ( NULL == key || key[0] == '\0' ) {
-        return;
+/*********************************************************************/
+/* Record queue (-q)                                                 */
+/*********************************************************************/
+
+/* Frees records that weren't read, too */
+static void
+free_queue( struct queue *q ) {
+    unsigned long i;
+
+    for ( i = q->head; i != q->tail; i ++ ) {
+        zsfree( q->slots[ i & q->mask ] );
+    }
+    if ( q->fd != -1 ) {
+        zclose( q->fd );
     }
+    if ( q->wfd != -1 ) {
+        close( q->wfd );
+    }
+    pthread_mutex_destroy( &q->mutex );
+    pthread_cond_destroy( &q->cond );
+    zfree( q->slots, ( q->mask + 1 ) * sizeof( char * ) );
+    zfree( q, sizeof( struct queue ) );
+}
 
-    HashTable ht = (HashTable) oconf->target_pm->gsu.h->getfn( oconf->target_pm );
-    if ( ! ht ) {
-        if ( oconf->debug ) {
-            fprintf( oconf->err, "zpopulator: Hash table `%s' is null\n", oconf->target );
-            fflush( oconf->err );
-        }
-        return;
+/* Created by main thread; `capacity' is rounded up to
+ * a power of two */
+static struct queue *
+new_queue( int capacity ) {
+    struct queue *q;
+    unsigned long size = 2;
+    int fds[ 2 ];
+
+    while ( size < (unsigned long) capacity && size < QUEUE_MAX ) {
+        size *= 2;
     }
-    Param val_pm = (Param) ht->getnode( ht, key );
 
-    /* Entry for key doesn't exist ? */
-    if ( ! val_pm ) {
-        val_pm = (Param) my_zshcalloc( sizeof (*val_pm) );
-        val_pm->node.flags = PM_SCALAR | PM_HASHELEM;
-	assigngetset(val_pm); // free of signal queueing
+    q = (struct queue *) zshcalloc( sizeof( struct queue ) );
+    q->slots = (char **) zshcalloc( size * sizeof( char * ) );
+    q->mask = size - 1;
+    pthread_mutex_init( &q->mutex, NULL );
+    pthread_cond_init( &q->cond, NULL );
 
-        my_strsetfn( val_pm, my_ztrdup(value) );
-        ht->addnode( ht, my_ztrdup( key ), val_pm );
-    } else {
-        my_strsetfn( val_pm, my_ztrdup(value) );
+    if ( pipe( fds ) == -1 ) {
+        q->fd = q->wfd = -1;
+        free_queue( q );
+        return NULL;
+    }
+
+    q->fd = movefd( fds[ 0 ] );
+    q->wfd = fds[ 1 ];
+    if ( q->fd == -1 ) {
+        free_queue( q );
+        return NULL;
     }
+    addmodulefd( q->fd, FDT_MODULE );
+    fcntl( q->wfd, F_SETFD, FD_CLOEXEC );
+
+    /* Worker never blocks on the pipe, and zpread drains
+     * it without blocking - the ring holds the data */
+    fcntl( q->fd, F_SETFL, fcntl( q->fd, F_GETFL ) | O_NONBLOCK );
+    fcntl( q->wfd, F_SETFL, fcntl( q->wfd, F_GETFL ) | O_NONBLOCK );
+
+    return q;
 }
 
-static void
-show_help() {
-    printf( "Usage: zpin \"source_program\" | zpopulator [-a name|-A name|-x] [-d string] [-D string] WORKER_ID\n");
-    printf( "Options:\n" );
-    printf( " -a name - put input into global array `name'\n" );
-    printf( " -A name - put input into global hash `name', keys and values\n" );
-    printf( "           alternating\n" );
-    printf( " -x - put input into global variables, names and values determined\n" );
-    printf( "      as with hash (-d/-D); variables must already exist\n" );
-    printf( " -d string - main delimeter dividing into array elements (default: \"\\n\")\n" );
-    printf( " -D string - sub-delimeter, to divide into key and value (default: \":\")\n" );
-    printf( " -g - ensure that there are only global variables in use - saves\n" );
-    printf( "      disappointments when learning that output variable must\n" );
-    printf( "      continuously live during computation\n" );
-    printf( " WORKER_ID - number of worker slot to use, 1..%d\n", WORKER_COUNT );
-    fflush( stdout );
+static int
+queue_empty( struct queue *q ) {
+    return __atomic_load_n( &q->tail, __ATOMIC_ACQUIRE ) == q->head;
 }
 
-static void
-show_help_zpin() {
-    printf( "Usage: zpin \"<zsh code>\" | zpopulator ... <WORKER_ID>\n");
-    fflush( stdout );
+/* Called by worker, takes ownership of `str'. Waits while
+ * the ring is full - this bounds the memory in use */
+static int
+queue_cancelled( struct queue *q ) {
+    return __atomic_load_n( &q->cancelled, __ATOMIC_ACQUIRE );
 }
 
-static
-void free_oconf( struct outconf *oconf ) {
-    if ( oconf ) {
-        if ( NULL == oconf->stream || fileno( oconf->stream ) == -1 ) {
-            int file = oconf->stream ? fileno( oconf->stream ) : 0;
-            fprintf( oconf->err, "zpopulator: Input fail: %p (%d), %s\n", oconf->stream, file, strerror( errno ) );
-            fflush( oconf->err );
-        } else {
-            if ( -1 != fcntl( fileno( oconf->stream ), F_GETFD ) ) {
-                /* fclose: "dissociates the named stream from
-                 * its underlying file or set of functions"
-                 */
-                if ( 0 != fclose( oconf->stream ) ) {
-                    fprintf( oconf->err, "zpopulator: Warning: could not close input stream (%p): %s\n", oconf->stream, strerror( errno ) );
-                    fflush( oconf->err );
-                    /* TODO */
-                }
-            }
-        }
+/* Returns 0 when the queue is cancelled, `str' isn't
+ * taken then */
+static int
+queue_push( struct queue *q, char *str ) {
+    unsigned long tail = q->tail;
 
-        if ( -1 != fcntl( fileno( oconf->err ), F_GETFD ) ) {
-            if ( 0 != fclose( oconf->err ) ) {
-                /* TODO */
-            }
-        }
+    if ( queue_cancelled( q ) ) {
+        return 0;
+    }
 
-        if ( oconf->target ) {
-            zsfree( oconf->target );
+    /* Sequentially consistent accesses of `head', `tail'
+     * and `waiting' pair with the ones in queue_pop(), so
+     * no wakeup can be lost */
+    if ( tail - __atomic_load_n( &q->head, __ATOMIC_SEQ_CST ) > q->mask ) {
+        pthread_mutex_lock( &q->mutex );
+        __atomic_store_n( &q->waiting, 1, __ATOMIC_SEQ_CST );
+        while ( tail - __atomic_load_n( &q->head, __ATOMIC_SEQ_CST ) > q->mask && ! queue_cancelled( q ) ) {
+            pthread_cond_wait( &q->cond, &q->mutex );
         }
-        if ( oconf->main_d ) {
-            zsfree( oconf->main_d );
+        __atomic_store_n( &q->waiting, 0, __ATOMIC_SEQ_CST );
+        pthread_mutex_unlock( &q->mutex );
+        if ( queue_cancelled( q ) ) {
+            return 0;
         }
-        if ( oconf->sub_d ) {
-            zsfree( oconf->sub_d );
-        }
-        zfree( oconf, sizeof( struct outconf ) );
     }
-}
-
-static
-void free_oconf_thread_safe( struct outconf *oconf ) {
-    if ( oconf ) {
-        if ( NULL == oconf->stream || fileno( oconf->stream ) == -1 ) {
-            int file = oconf->stream ? fileno( oconf->stream ): 0;
-            fprintf( oconf->err, "zpopulator: (thread) Input fail: %p (%d), %s\n", oconf->stream, file, strerror( errno ) );
-            fflush( oconf->err );
-        } else {
-            if ( -1 != fcntl( fileno( oconf->stream ), F_GETFD ) ) {
-                /* fclose: "dissociates the named stream from
-                 * its underlying file or set of functions"
-                 */
-                if ( 0 != fclose( oconf->stream ) ) {
-                    fprintf( oconf->err, "zpopulator: (thread) Warning: could not close input stream (%p): %s\n", oconf->stream, strerror( errno ) );
-                    fflush( oconf->err );
-                    /* TODO */
-                }
-            }
-        }
 
-        if ( -1 != fcntl( fileno( oconf->err ), F_GETFD ) ) {
-            if ( 0 != fclose( oconf->err ) ) {
-                /* TODO */
-            }
-        }
+    q->slots[ tail & q->mask ] = str;
+    __atomic_store_n( &q->tail, tail + 1, __ATOMIC_SEQ_CST );
 
-        if ( oconf->target ) {
-            my_zsfree( oconf->target );
-        }
-        if ( oconf->main_d ) {
-            my_zsfree( oconf->main_d );
+    /* Consumer may be sleeping on empty ring */
+    if ( __atomic_load_n( &q->head, __ATOMIC_SEQ_CST ) == tail ) {
+        if ( write( q->wfd, "1", 1 ) == -1 ) {
+            /* Pipe is full, so it's readable anyway */
         }
-        if ( oconf->sub_d ) {
-            my_zsfree( oconf->sub_d );
-        }
-        my_zfree( oconf, sizeof( struct outconf ) );
     }
+    return 1;
 }
 
-/* this function is run by the second thread */
-static
-void *process_input( void *void_ptr ) {
-    static int ret_success = 0, ret_failure = 1;
-    char *buf, *found;
-    int bufsize = 256, index = 0;
+/* Wakes the worker if it waits for room; called by
+ * main thread */
+static void
+queue_cancel( struct queue *q ) {
+    pthread_mutex_lock( &q->mutex );
+    __atomic_store_n( &q->cancelled, 1, __ATOMIC_RELEASE );
+    pthread_cond_signal( &q->cond );
+    pthread_mutex_unlock( &q->mutex );
+}
 
-    /* Instructs what to do */
-    struct outconf *oconf = ( struct outconf *) void_ptr;
+/* Called by main thread, returns NULL when ring is empty */
+static char *
+queue_pop( struct queue *q ) {
+    unsigned long head = q->head;
 
-    int tries = 0;
+    if ( __atomic_load_n( &q->tail, __ATOMIC_SEQ_CST ) == head ) {
+        return NULL;
+    }
 
-duplicate_stdin:
-    /* Duplicate standard input */
-    oconf->stream = fdopen( dup( fileno( stdin ) ), "r" );
+    char *str = q->slots[ head & q->mask ];
+    __atomic_store_n( &q->head, head + 1, __ATOMIC_SEQ_CST );
 
-    ++ tries;
+    if ( __atomic_load_n( &q->waiting, __ATOMIC_SEQ_CST ) ) {
+        pthread_mutex_lock( &q->mutex );
+        pthread_cond_signal( &q->cond );
+        pthread_mutex_unlock( &q->mutex );
+    }
 
-    if ( NULL == oconf->stream || fileno( oconf->stream ) == -1 ) {
-        int file = oconf->stream ? fileno( oconf->stream ) : 0;
-        fprintf( stderr, "Failed to duplicate stream [%d]: %p (%d), %s\n", tries, oconf->stream, file, strerror( errno ) );
-        fflush( stderr );
-        if ( tries < 8 ) {
-            goto duplicate_stdin;
-        } else {
-            pthread_mutex_lock( &oconf->mutex );
-            pthread_cond_signal( &oconf->cond );
-            pthread_mutex_unlock( &oconf->mutex );
+    return str;
+}
 
-            oconf->stream = NULL;
-            free_oconf_thread_safe( oconf );
-            return NULL;
-        }
+/* Empties the data pipe before the ring is checked */
+static void
+queue_drain_fd( struct queue *q ) {
+    char buf[ 64 ];
+    while ( read( q->fd, buf, sizeof( buf ) ) > 0 ) {
     }
+}
 
-    pthread_mutex_lock( &oconf->mutex );
-    pthread_cond_signal( &oconf->cond );
-    pthread_mutex_unlock( &oconf->mutex );
+/*********************************************************************/
+/* Worker registry                                                   */
+/*********************************************************************/
 
-    /* Submit the FD to Zsh */
-    addmodulefd( fileno( oconf->stream ), FDT_MODULE );
+/* Adds slots so that there are at least `size' of them */
+static int
+grow_workers( int size ) {
+    int i, newsize = workers_size ? workers_size : 8;
 
-    buf = malloc( bufsize );
-    if ( ! buf ) {
-        if ( ! oconf->silent ) {
+    if ( size <= workers_size ) {
+        return 1;
+    }
+
+    while ( newsize < size ) {
+        newsize *= 2;
+    }
+
+    struct worker **nworkers = (struct worker **) zrealloc( workers, newsize * sizeof( struct worker * ) );
+    if ( ! nworkers ) {
+        return 0;
+    }
+    workers = nworkers;
+
+    /* Only main thread reads $zpworker_finished */
+    char **nfinished = (char **) zrealloc( worker_finished, ( newsize + 1 ) * sizeof( char * ) );
+    if ( ! nfinished ) {
+        return 0;
+    }
+    worker_finished = nfinished;
+
+    char **nfd = (char **) zrealloc( worker_fd, ( newsize + 1 ) * sizeof( char * ) );
+    if ( ! nfd ) {
+        return 0;
+    }
+    worker_fd = nfd;
+
+    for ( i = workers_size; i < newsize; i ++ ) {
+        workers[ i ] = (struct worker *) zshcalloc( sizeof( struct worker ) );
+        workers[ i ]->state = WORKER_FREE;
+        strcpy( workers[ i ]->finished, "1" );
+        worker_finished[ i ] = workers[ i ]->finished;
+        workers[ i ]->fd = workers[ i ]->wfd = -1;
+        worker_fd[ i ] = workers[ i ]->fdstr;
+    }
+    worker_finished[ newsize ] = NULL;
+    worker_fd[ newsize ] = NULL;
+    workers_size = newsize;
+
+    return 1;
+}
+
+/* Creates readiness pipe of the slot, in main thread */
+static int
+open_worker_fd( struct worker *w ) {
+    int fds[ 2 ];
+
+    if ( pipe( fds ) == -1 ) {
+        return 0;
+    }
+
+    /* Keep out of the way of user's descriptors */
+    w->fd = movefd( fds[ 0 ] );
+    if ( w->fd == -1 ) {
+        close( fds[ 1 ] );
+        return 0;
+    }
+    addmodulefd( w->fd, FDT_MODULE );
+
+    /* Write end isn't known to the shell, don't let
+     * it leak into executed programs */
+    w->wfd = fds[ 1 ];
+    fcntl( w->wfd, F_SETFD, FD_CLOEXEC );
+
+    sprintf( w->fdstr, "%d", w->fd );
+    return 1;
+}
+
+static void
+close_worker_fd( struct worker *w ) {
+    if ( w->fd != -1 ) {
+        zclose( w->fd );
+        w->fd = -1;
+    }
+    if ( w->wfd != -1 ) {
+        close( w->wfd );
+        w->wfd = -1;
+    }
+    w->fdstr[ 0 ] = '\0';
+}
+
+/* Joins finished thread, so that its slot can be reused;
+ * slot with records still queued for zpread is kept */
+static void
+recycle_worker( struct worker *w ) {
+    if ( __atomic_load_n( &w->state, __ATOMIC_ACQUIRE ) == WORKER_FINISHED ) {
+        if ( w->queue ) {
+            /* Cancelled queue's records are dropped */
+            if ( ! queue_empty( w->queue ) && ! queue_cancelled( w->queue ) ) {
+                return;
+            }
+            free_queue( w->queue );
+            w->queue = NULL;
+        }
+        pthread_join( w->thread, NULL );
+        close_worker_fd( w );
+        for ( int i = 0; i < w->nclosefds; i ++ ) {
+            zclose( w->closefds[ i ] );
+        }
+        free( w->closefds );
+        w->closefds = NULL;
+        w->nclosefds = 0;
+        w->state = WORKER_FREE;
+    }
+}
+
+/* Called by worker thread, for descriptor of the shell's
+ * fdtable; a bare close() would leave its entry behind.
+ * Room for all of them is allocated before the worker
+ * starts, see CLOSEFDS_MAX() */
+static void
+hand_back_fd( struct worker *w, int fd ) {
+    w->closefds[ w->nclosefds ++ ] = fd;
+}
+
+/* Returns 0-based slot index; `id' is 1-based ID wanted
+ * by the user or 0 to pick first slot that isn't busy */
+static int
+acquire_worker( int id, int silent ) {
+    int i;
+
+    if ( id > WORKERS_MAX ) {
+        if ( ! silent ) {
+            fprintf( stderr, "zpopulator: Worker ID %d is too large, at most %d, aborting\n", id, WORKERS_MAX );
+            fflush( stderr );
+        }
+        return -1;
+    }
+
+    if ( id > 0 ) {
+        if ( ! grow_workers( id ) ) {
+            return -1;
+        }
+        recycle_worker( workers[ id - 1 ] );
+        if ( workers[ id - 1 ]->state != WORKER_FREE ) {
+            if ( ! silent ) {
+                fprintf( stderr, "zpopulator: Worker %d is still running or has queued records, aborting\n", id );
+                fflush( stderr );
+            }
+            return -1;
+        }
+        return id - 1;
+    }
+
+    for ( i = 0; i < workers_size; i ++ ) {
+        recycle_worker( workers[ i ] );
+        if ( workers[ i ]->state == WORKER_FREE ) {
+            return i;
+        }
+    }
+
+    if ( workers_size >= WORKERS_MAX ) {
+        if ( ! silent ) {
+            fprintf( stderr, "zpopulator: All %d workers are busy, aborting\n", WORKERS_MAX );
+            fflush( stderr );
+        }
+        return -1;
+    }
+
+    if ( ! grow_workers( workers_size + 1 ) ) {
+        return -1;
+    }
+    return i;
+}
+
+/*********************************************************************/
+/* Worker statistics                                                 */
+/*********************************************************************/
+
+static int64_t
+now_ns() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Stage clock - time stamp counter where there is one, it
+ * is read without a system call; nanoseconds otherwise */
+static inline uint64_t
+zp_ticks() {
+#ifdef ZP_X86_SIMD
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+/* Clock readings from boot_(), to convert ticks to time */
+static uint64_t boot_ticks;
+static int64_t boot_ns;
+
+static double
+ns_per_tick() {
+    int64_t ns = now_ns() - boot_ns;
+    uint64_t ticks = zp_ticks() - boot_ticks;
+    if ( ns <= 0 || ticks == 0 ) {
+        return 1.0;
+    }
+    return (double) ns / ticks;
+}
+
+static void
+stage_end( int stage, uint64_t t0 ) {
+    STAT_ADD( thread_stats->ticks[ stage ], zp_ticks() - t0 );
+    STAT_ADD( thread_stats->calls[ stage ], 1 );
+}
+
+/* Called by main thread, before the worker starts */
+static void
+reset_stats( struct workerstats *st ) {
+    STAT_SET( st->bytes, 0 );
+    STAT_SET( st->records, 0 );
+    STAT_SET( st->inserted, 0 );
+    STAT_SET( st->hiwater, 0 );
+    STAT_SET( st->allocs, 0 );
+    for ( int i = 0; i < STAGES; i ++ ) {
+        STAT_SET( st->ticks[ i ], 0 );
+        STAT_SET( st->calls[ i ], 0 );
+    }
+    STAT_SET( st->end_ns, 0 );
+    STAT_SET( st->start_ns, now_ns() );
+}
+
+/* Element of $zpworker_stats, on the heap; NULL if
+ * the slot was never used */
+static char *
+format_stats( struct worker *w ) {
+    struct workerstats *st = &w->stats;
+    char line[ 192 ];
+
+    int64_t start = STAT_GET( st->start_ns );
+    if ( ! start ) {
+        return NULL;
+    }
+    int64_t end = STAT_GET( st->end_ns );
+    if ( ! end ) {
+        end = now_ns();
+    }
+
+    long bytes = STAT_GET( st->bytes );
+    double elapsed = ( end - start ) / 1e9;
+
+    snprintf( line, sizeof( line ), "bytes=%ld records=%ld inserted=%ld hiwater=%ld allocs=%ld elapsed=%.6f rate=%.0f",
+              bytes, STAT_GET( st->records ), STAT_GET( st->inserted ), STAT_GET( st->hiwater ),
+              STAT_GET( st->allocs ), elapsed, elapsed > 0 ? bytes / elapsed : 0.0 );
+    return dupstring( line );
+}
+
+/* Returns slot of 1-based ID `name', or NULL */
+static struct worker *
+worker_by_name( const char *name ) {
+    char *end;
+    long id = strtol( name, &end, 10 );
+
+    if ( *name == '\0' || *end != '\0' || id < 1 || id > workers_size ) {
+        return NULL;
+    }
+    return workers[ id - 1 ];
+}
+
+static HashNode
+getpmworkerstats( UNUSED(HashTable ht), const char *name ) {
+    Param pm = (Param) hcalloc( sizeof( struct param ) );
+    struct worker *w = worker_by_name( name );
+
+    pm->node.nam = dupstring( name );
+    pm->node.flags = PM_SCALAR | PM_READONLY;
+    pm->gsu.s = &nullsetscalar_gsu;
+
+    if ( ! w || ! ( pm->u.str = format_stats( w ) ) ) {
+        pm->u.str = dupstring( "" );
+        pm->node.flags |= PM_UNSET;
+    }
+
+    return &pm->node;
+}
+
+static void
+scanpmworkerstats( UNUSED(HashTable ht), ScanFunc func, int flags ) {
+    struct param pm;
+    char name[ 12 ];
+    int i;
+
+    memset( &pm, 0, sizeof( pm ) );
+    pm.node.flags = PM_SCALAR | PM_READONLY;
+    pm.gsu.s = &nullsetscalar_gsu;
+
+    for ( i = 0; i < workers_size; i ++ ) {
+        if ( ! STAT_GET( workers[ i ]->stats.start_ns ) ) {
+            continue;
+        }
+        sprintf( name, "%d", i + 1 );
+        pm.node.nam = name;
+        if ( func != scancountparams &&
+             ( ( flags & ( SCANPM_WANTVALS | SCANPM_MATCHVAL ) ) ||
+               ! ( flags & SCANPM_WANTKEYS ) ) )
+        {
+            pm.u.str = format_stats( workers[ i ] );
+        }
+        func( &pm.node, flags );
+    }
+}
+
+/*********************************************************************/
+/* Delimeter search                                                  */
+/*********************************************************************/
+
+static const char * find_byte_memchr( const char *s, int c, size_t n );
+
+/* Search for single byte, selected in boot_() for running CPU */
+static const char * (*find_byte)( const char *s, int c, size_t n ) = find_byte_memchr;
+
+static const char *
+find_byte_memchr( const char *s, int c, size_t n ) {
+    return (const char *) memchr( s, c, n );
+}
+
+#ifdef ZP_X86_SIMD
+__attribute__(( target( "sse2" ) ))
+static const char *
+find_byte_sse2( const char *s, int c, size_t n ) {
+    const __m128i needle = _mm_set1_epi8( (char) c );
+
+    while ( n >= 16 ) {
+        __m128i chunk = _mm_loadu_si128( (const __m128i *) s );
+        int mask = _mm_movemask_epi8( _mm_cmpeq_epi8( chunk, needle ) );
+        if ( mask ) {
+            return s + __builtin_ctz( mask );
+        }
+        s += 16;
+        n -= 16;
+    }
+
+    return find_byte_memchr( s, c, n );
+}
+
+__attribute__(( target( "avx2" ) ))
+static const char *
+find_byte_avx2( const char *s, int c, size_t n ) {
+    const __m256i needle = _mm256_set1_epi8( (char) c );
+
+    while ( n >= 32 ) {
+        __m256i chunk = _mm256_loadu_si256( (const __m256i *) s );
+        unsigned mask = (unsigned) _mm256_movemask_epi8( _mm256_cmpeq_epi8( chunk, needle ) );
+        if ( mask ) {
+            return s + __builtin_ctz( mask );
+        }
+        s += 32;
+        n -= 32;
+    }
+
+    return find_byte_sse2( s, c, n );
+}
+#endif
+
+/* Search for first quote or backslash - the bytes that end
+ * a run of JSON string contents. Selected in boot_() */
+static const char * find_quote_scalar( const char *s, size_t n );
+static const char * (*find_quote)( const char *s, size_t n ) = find_quote_scalar;
+
+static const char *
+find_quote_scalar( const char *s, size_t n ) {
+    const char *end = s + n;
+    for ( ; s < end; s ++ ) {
+        if ( *s == '"' || *s == '\\' ) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+#ifdef ZP_X86_SIMD
+__attribute__(( target( "sse2" ) ))
+static const char *
+find_quote_sse2( const char *s, size_t n ) {
+    const __m128i quote = _mm_set1_epi8( '"' );
+    const __m128i bslash = _mm_set1_epi8( '\\' );
+
+    while ( n >= 16 ) {
+        __m128i chunk = _mm_loadu_si128( (const __m128i *) s );
+        int mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( chunk, quote ),
+                                                    _mm_cmpeq_epi8( chunk, bslash ) ) );
+        if ( mask ) {
+            return s + __builtin_ctz( mask );
+        }
+        s += 16;
+        n -= 16;
+    }
+
+    return find_quote_scalar( s, n );
+}
+
+__attribute__(( target( "avx2" ) ))
+static const char *
+find_quote_avx2( const char *s, size_t n ) {
+    const __m256i quote = _mm256_set1_epi8( '"' );
+    const __m256i bslash = _mm256_set1_epi8( '\\' );
+
+    while ( n >= 32 ) {
+        __m256i chunk = _mm256_loadu_si256( (const __m256i *) s );
+        unsigned mask = (unsigned) _mm256_movemask_epi8( _mm256_or_si256( _mm256_cmpeq_epi8( chunk, quote ),
+                                                                          _mm256_cmpeq_epi8( chunk, bslash ) ) );
+        if ( mask ) {
+            return s + __builtin_ctz( mask );
+        }
+        s += 32;
+        n -= 32;
+    }
+
+    return find_quote_sse2( s, n );
+}
+#endif
+
+static void
+select_find_byte() {
+#ifdef ZP_X86_SIMD
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "avx2" ) ) {
+        find_byte = find_byte_avx2;
+        find_quote = find_quote_avx2;
+    } else if ( __builtin_cpu_supports( "sse2" ) ) {
+        find_byte = find_byte_sse2;
+        find_quote = find_quote_sse2;
+    } else {
+        find_byte = find_byte_memchr;
+        find_quote = find_quote_scalar;
+    }
+#else
+    find_byte = find_byte_memchr;
+    find_quote = find_quote_scalar;
+#endif
+}
+
+/* Takes ownership of unmetafied `str' of length `len' */
+static void
+set_delimiter( struct delimiter *d, char *str, int len ) {
+    int i;
+
+    d->str = str;
+    d->len = len;
+
+    /* Horspool's bad character shifts, for the multi-byte case */
+    for ( i = 0; i < 256; i ++ ) {
+        d->skip[ i ] = len;
+    }
+    for ( i = 0; i < len - 1; i ++ ) {
+        d->skip[ (unsigned char) str[ i ] ] = len - 1 - i;
+    }
+}
+
+/* Finds first occurrence of delimeter in `n' bytes at `s',
+ * which don't have to be null-terminated */
+static const char *
+find_delim( const struct delimiter *d, const char *s, size_t n ) {
+    if ( d->len == 1 ) {
+        return find_byte( s, (unsigned char) d->str[ 0 ], n );
+    }
+
+    size_t i = 0, last = d->len - 1;
+    unsigned char lastc = d->str[ last ];
+
+    while ( i + d->len <= n ) {
+        unsigned char c = s[ i + last ];
+        if ( c == lastc && 0 == memcmp( s + i, d->str, last ) ) {
+            return s + i;
+        }
+        i += d->skip[ c ];
+    }
+
+    return NULL;
+}
+
+/* Searches for the main delimeter, as STAGE_SCAN */
+static inline const char *
+scan_delim( struct outconf *oconf, const char *s, size_t n ) {
+    STAGE_BEGIN( t0 );
+    const char *found = find_delim( &oconf->main_d, s, n );
+    STAGE_END( STAGE_SCAN, t0 );
+    return found;
+}
+
+/* Searches record for the sub-delimeter, as STAGE_SPLIT */
+static inline const char *
+split_delim( struct outconf *oconf, const char *s, size_t n ) {
+    STAGE_BEGIN( t0 );
+    const char *found = find_delim( &oconf->sub_d, s, n );
+    STAGE_END( STAGE_SPLIT, t0 );
+    return found;
+}
+
+/*********************************************************************/
+/* Framing of input without delimeters (-F)                          */
+/*********************************************************************/
+
+/* One unit of framed input. `key' is NULL when `val' is
+ * a whole record, to be split by the sub-delimeter */
+struct frame {
+    const char *key;
+    int klen;
+    const char *val;
+    int vlen;
+};
+
+/* Finds one field of a NUL, netstring or length-prefixed
+ * framing. Returns number of bytes it takes, 0 when it
+ * isn't complete yet, -1 when input is malformed */
+static long
+next_field( struct outconf *oconf, const char *p, size_t n, int eof, const char **field, int *flen ) {
+    const char *q;
+    size_t len = 0;
+
+    switch ( oconf->framing ) {
+        case FRAME_NUL:
+            STAGE_BEGIN( t0 );
+            q = find_byte( p, '\0', n );
+            STAGE_END( STAGE_SCAN, t0 );
+            if ( q ) {
+                *field = p;
+                *flen = q - p;
+                return q - p + 1;
+            }
+            /* Last field doesn't need a terminator */
+            if ( eof && n > 0 && n <= INT_MAX ) {
+                *field = p;
+                *flen = n;
+                return n;
+            }
+            return 0;
+
+        case FRAME_NET:
+            /* "5:hello," */
+            for ( q = p; q < p + n && idigit( *q ); q ++ ) {
+                len = len * 10 + ( *q - '0' );
+                if ( len > INT_MAX ) {
+                    return -1;
+                }
+            }
+            if ( q == p + n ) {
+                return q - p > 10 ? -1 : 0;
+            }
+            if ( q == p || *q != ':' ) {
+                return -1;
+            }
+            q ++;
+            if ( (size_t) ( p + n - q ) < len + 1 ) {
+                return 0;
+            }
+            if ( q[ len ] != ',' ) {
+                return -1;
+            }
+            *field = q;
+            *flen = len;
+            return q - p + len + 1;
+
+        case FRAME_LEN:
+            /* 32-bit big-endian length, then the bytes */
+            if ( n < 4 ) {
+                return 0;
+            }
+            len = (size_t) (unsigned char) p[ 0 ] << 24 | (size_t) (unsigned char) p[ 1 ] << 16 |
+                  (size_t) (unsigned char) p[ 2 ] << 8 | (size_t) (unsigned char) p[ 3 ];
+            if ( len > INT_MAX ) {
+                return -1;
+            }
+            if ( n - 4 < len ) {
+                return 0;
+            }
+            *field = p + 4;
+            *flen = len;
+            return len + 4;
+    }
+    return -1;
+}
+
+/* Finds next unit of framed input, see next_field() for
+ * the return value. In hash and variable mode, fields are
+ * paired into key and value */
+static long
+next_frame( struct outconf *oconf, const char *p, size_t n, int eof, struct frame *fr ) {
+    long c1, c2;
+
+    if ( oconf->framing == FRAME_FIXED ) {
+        int width = oconf->fixed_len;
+        if ( n < (size_t) width ) {
+            return eof && n > 0 ? -1 : 0;
+        }
+        if ( oconf->fixed_key && ( oconf->mode == OUTPUT_HASH || oconf->mode == OUTPUT_VARS ) ) {
+            /* Key is padded with spaces or NULs */
+            int klen = oconf->fixed_key;
+            while ( klen > 0 && ( p[ klen - 1 ] == ' ' || p[ klen - 1 ] == '\0' ) ) {
+                klen --;
+            }
+            fr->key = p;
+            fr->klen = klen;
+            fr->val = p + oconf->fixed_key;
+            fr->vlen = width - oconf->fixed_key;
+        } else {
+            fr->key = NULL;
+            fr->val = p;
+            fr->vlen = width;
+        }
+        return width;
+    }
+
+    if ( oconf->mode != OUTPUT_HASH && oconf->mode != OUTPUT_VARS ) {
+        fr->key = NULL;
+        return next_field( oconf, p, n, eof, &fr->val, &fr->vlen );
+    }
+
+    if ( ( c1 = next_field( oconf, p, n, eof, &fr->key, &fr->klen ) ) <= 0 ) {
+        return c1;
+    }
+    c2 = next_field( oconf, p + c1, n - c1, eof, &fr->val, &fr->vlen );
+    if ( c2 == 0 && eof && (size_t) c1 == n ) {
+        /* Key without value at end of input */
+        fr->val = "";
+        fr->vlen = 0;
+        return c1;
+    }
+    return c2 <= 0 ? c2 : c1 + c2;
+}
+
+static void
+frame_error( struct outconf *oconf ) {
+    if ( ! oconf->silent ) {
+        fprintf( oconf->err, "zpopulator: Malformed or truncated input (-F), dropping the rest\n" );
+        fflush( oconf->err );
+    }
+    oconf->worker->error = "format";
+}
+
+/*********************************************************************/
+/* JSON Lines input (-J)                                             */
+/*********************************************************************/
+
+/* Position in a record being parsed */
+struct jscan {
+    const char *p;
+    const char *end;
+};
+
+static int
+jbuf_reserve( struct jbuf *jb, size_t size ) {
+    if ( size <= (size_t) jb->size ) {
+        return 1;
+    }
+    if ( size > INT_MAX ) {
+        return 0;
+    }
+    char *buf = realloc( jb->buf, size );
+    COUNT_ALLOC();
+    if ( ! buf ) {
+        return 0;
+    }
+    jb->buf = buf;
+    jb->size = size;
+    return 1;
+}
+
+static void
+free_jpath( struct jpath *jp ) {
+    if ( jp->str ) {
+        my_zsfree( jp->str );
+        my_zfree( jp->names, jp->depth * sizeof( char * ) );
+        my_zfree( jp->lens, jp->depth * sizeof( int ) );
+        jp->str = NULL;
+    }
+}
+
+static void
+free_jbufs( struct outconf *oconf ) {
+    int i;
+    for ( i = 0; i < 3; i ++ ) {
+        if ( oconf->jbufs[ i ].buf ) {
+            free( oconf->jbufs[ i ].buf );
+            oconf->jbufs[ i ].buf = NULL;
+            oconf->jbufs[ i ].size = 0;
+        }
+    }
+}
+
+static void
+json_ws( struct jscan *js ) {
+    while ( js->p < js->end && ( *js->p == ' ' || *js->p == '\t' || *js->p == '\r' || *js->p == '\n' ) ) {
+        js->p ++;
+    }
+}
+
+/* Takes `c' if it's the next byte */
+static int
+json_expect( struct jscan *js, char c ) {
+    json_ws( js );
+    if ( js->p < js->end && *js->p == c ) {
+        js->p ++;
+        return 1;
+    }
+    return 0;
+}
+
+static int
+json_hex4( const char *p, unsigned *u ) {
+    int i;
+
+    *u = 0;
+    for ( i = 0; i < 4; i ++ ) {
+        int c = (unsigned char) p[ i ], d;
+        if ( c >= '0' && c <= '9' ) {
+            d = c - '0';
+        } else if ( ( c | 0x20 ) >= 'a' && ( c | 0x20 ) <= 'f' ) {
+            d = ( c | 0x20 ) - 'a' + 10;
+        } else {
+            return 0;
+        }
+        *u = *u << 4 | d;
+    }
+    return 1;
+}
+
+static char *
+utf8_put( char *o, unsigned cp ) {
+    if ( cp < 0x80 ) {
+        *o ++ = cp;
+    } else if ( cp < 0x800 ) {
+        *o ++ = 0xc0 | cp >> 6;
+        *o ++ = 0x80 | ( cp & 0x3f );
+    } else if ( cp < 0x10000 ) {
+        *o ++ = 0xe0 | cp >> 12;
+        *o ++ = 0x80 | ( ( cp >> 6 ) & 0x3f );
+        *o ++ = 0x80 | ( cp & 0x3f );
+    } else {
+        *o ++ = 0xf0 | cp >> 18;
+        *o ++ = 0x80 | ( ( cp >> 12 ) & 0x3f );
+        *o ++ = 0x80 | ( ( cp >> 6 ) & 0x3f );
+        *o ++ = 0x80 | ( cp & 0x3f );
+    }
+    return o;
+}
+
+/* Reads string at the opening quote. Contents without
+ * escapes are returned in place; otherwise they are decoded
+ * into `jb', or only skipped if it's NULL. Decoded string
+ * is never longer than its source */
+static int
+json_string( struct jscan *js, struct jbuf *jb, const char **s, int *len ) {
+    const char *p = js->p + 1, *end = js->end, *q;
+    char *o = NULL;
+
+    q = find_quote( p, end - p );
+    if ( ! q ) {
+        return 0;
+    }
+    if ( *q == '"' ) {
+        *s = p;
+        *len = q - p;
+        js->p = q + 1;
+        return 1;
+    }
+
+    if ( jb ) {
+        if ( ! jbuf_reserve( jb, end - p ) ) {
+            return 0;
+        }
+        o = jb->buf;
+    }
+
+    while ( 1 ) {
+        if ( o ) {
+            memcpy( o, p, q - p );
+            o += q - p;
+        }
+        if ( *q == '"' ) {
+            break;
+        }
+
+        /* Backslash */
+        p = q + 1;
+        if ( p >= end ) {
+            return 0;
+        }
+        char c = *p ++;
+        if ( c == 'u' ) {
+            unsigned cp, lo;
+            if ( end - p < 4 || ! json_hex4( p, &cp ) ) {
+                return 0;
+            }
+            p += 4;
+            if ( cp >= 0xd800 && cp < 0xdc00 && end - p >= 6 && p[ 0 ] == '\\' && p[ 1 ] == 'u' &&
+                 json_hex4( p + 2, &lo ) && lo >= 0xdc00 && lo < 0xe000 )
+            {
+                cp = 0x10000 + ( ( cp - 0xd800 ) << 10 ) + ( lo - 0xdc00 );
+                p += 6;
+            } else if ( cp >= 0xd800 && cp < 0xe000 ) {
+                /* Lone surrogate */
+                cp = 0xfffd;
+            }
+            if ( o ) {
+                o = utf8_put( o, cp );
+            }
+        } else {
+            switch ( c ) {
+                case '"': case '\\': case '/': break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                default: return 0;
+            }
+            if ( o ) {
+                *o ++ = c;
+            }
+        }
+
+        q = find_quote( p, end - p );
+        if ( ! q ) {
+            return 0;
+        }
+    }
+
+    if ( o ) {
+        *s = jb->buf;
+        *len = o - jb->buf;
+    }
+    js->p = q + 1;
+    return 1;
+}
+
+/* Skips value, returning its raw text */
+static int
+json_skip( struct jscan *js, const char **s, int *len ) {
+    const char *start, *d;
+    int depth = 0, dlen;
+
+    json_ws( js );
+    start = js->p;
+    if ( js->p >= js->end ) {
+        return 0;
+    }
+
+    if ( *js->p == '"' ) {
+        if ( ! json_string( js, NULL, &d, &dlen ) ) {
+            return 0;
+        }
+    } else if ( *js->p == '{' || *js->p == '[' ) {
+        /* Strings are skipped whole, so their brackets
+         * aren't counted */
+        while ( js->p < js->end ) {
+            char c = *js->p;
+            if ( c == '"' ) {
+                if ( ! json_string( js, NULL, &d, &dlen ) ) {
+                    return 0;
+                }
+                continue;
+            }
+            js->p ++;
+            if ( c == '{' || c == '[' ) {
+                depth ++;
+            } else if ( ( c == '}' || c == ']' ) && -- depth == 0 ) {
+                break;
+            }
+        }
+        if ( depth ) {
+            return 0;
+        }
+    } else {
+        while ( js->p < js->end && ! strchr( ",}] \t\r\n", *js->p ) ) {
+            js->p ++;
+        }
+        if ( js->p == start ) {
+            return 0;
+        }
+    }
+
+    *s = start;
+    *len = js->p - start;
+    return 1;
+}
+
+/* Value as shell sees it - string decoded, else raw text */
+static int
+json_value( struct jscan *js, struct jbuf *jb, const char **s, int *len ) {
+    json_ws( js );
+    if ( js->p < js->end && *js->p == '"' ) {
+        return json_string( js, jb, s, len );
+    }
+    return json_skip( js, s, len );
+}
+
+/* Moves to the value at `path', member names being decoded
+ * into third buffer. Returns 0 if there's no such value */
+static int
+json_find( struct outconf *oconf, struct jscan *js, struct jpath *path ) {
+    const char *name, *raw;
+    int nlen, rlen, d;
+
+    for ( d = 0; d < path->depth; d ++ ) {
+        if ( ! json_expect( js, '{' ) ) {
+            return 0;
+        }
+        while ( 1 ) {
+            json_ws( js );
+            if ( js->p >= js->end || *js->p != '"' ||
+                 ! json_string( js, &oconf->jbufs[ 2 ], &name, &nlen ) ||
+                 ! json_expect( js, ':' ) )
+            {
+                return 0;
+            }
+            if ( nlen == path->lens[ d ] && ! memcmp( name, path->names[ d ], nlen ) ) {
+                break;
+            }
+            if ( ! json_skip( js, &raw, &rlen ) || ! json_expect( js, ',' ) ) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void
+json_error( struct outconf *oconf, const char *rec, int len ) {
+    if ( oconf->json_bad ++ == 0 && ! oconf->silent ) {
+        fprintf( oconf->err, "zpopulator: Malformed JSON, skipping: %.*s\n", len > 80 ? 80 : len, rec );
+        fflush( oconf->err );
+    }
+    oconf->worker->error = "format";
+}
+
+/*********************************************************************/
+/* Metafication of stored data                                       */
+/*********************************************************************/
+
+/* Length of `len' bytes at `s' after metafication */
+static int
+metafied_len( const char *s, int len ) {
+    int i, mlen = len;
+    for ( i = 0; i < len; i ++ ) {
+        if ( imeta( s[ i ] ) ) {
+            mlen ++;
+        }
+    }
+    return mlen;
+}
+
+/* Metafies `len' bytes at `s' into `t', null-terminates */
+static void
+metafy_copy( char *t, const char *s, int len ) {
+    int i;
+    for ( i = 0; i < len; i ++ ) {
+        if ( imeta( s[ i ] ) ) {
+            *t++ = Meta;
+            *t++ = s[ i ] ^ 32;
+        } else {
+            *t++ = s[ i ];
+        }
+    }
+    *t = '\0';
+}
+
+/* Thread-safe metafy into new allocation - records can contain
+ * any bytes, including null bytes, and Zsh needs them metafied */
+static char *
+my_metafy_dup( const char *s, int len ) {
+    char *t = (char *) my_zalloc( metafied_len( s, len ) + 1 );
+    if ( t ) {
+        metafy_copy( t, s, len );
+    }
+    return t;
+}
+
+/* Metafies into worker's reused key buffer, optionally
+ * returning the metafied length in `mlenp' */
+static char *
+metafy_keybuf( struct outconf *oconf, const char *s, int len, int *mlenp ) {
+    STAGE_BEGIN( t0 );
+    int mlen = metafied_len( s, len );
+    if ( mlenp ) {
+        *mlenp = mlen;
+    }
+    if ( mlen + 1 > oconf->keybuf_size ) {
+        char *save_keybuf = oconf->keybuf;
+        oconf->keybuf_size = mlen + 1 > 2 * oconf->keybuf_size ? mlen + 1 : 2 * oconf->keybuf_size;
+        COUNT_ALLOC();
+        oconf->keybuf = realloc( oconf->keybuf, oconf->keybuf_size );
+        if ( ! oconf->keybuf ) {
+            free( save_keybuf );
+            oconf->keybuf_size = 0;
+            return NULL;
+        }
+    }
+    metafy_copy( oconf->keybuf, s, len );
+    STAGE_END( STAGE_SPLIT, t0 );
+    return oconf->keybuf;
+}
+
+static
+Param ensurethereishash( char *name, struct outconf *oconf ) {
+    Param pm;
+    int created = 0;
+
+    pm = (Param) paramtab->getnode( paramtab, name );
+    if ( ! pm ) {
+        pm = createparam( name, PM_HASHED );
+        if ( ! pm ) {
+            return NULL;
+        }
+        created = 1;
+    } else {
+        if ( oconf->only_global && pm->level != 0 ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "Non-global variable `%s' exists, aborting (-g)\n", name );
+                fflush( stderr );
+            }
+            return NULL;
+        }
+
+        if ( ! ( pm->node.flags & PM_HASHED ) ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "Variable `%s' isn't hash table, aborting\n", name );
+            }
+            return NULL;
+        }
+
+        if ( pm->node.flags & ( PM_SPECIAL | PM_READONLY ) ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "Variable `%s' is special or read-only, aborting\n", name );
+            }
+            return NULL;
+        }
+
+        /* Index can only be replaced as a whole */
+        if ( pm->u.hash && is_zpindex( pm->u.hash ) && ! oconf->private_hash ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "Variable `%s' is an index (-I), use -p or -I to replace it, aborting\n", name );
+                fflush( stderr );
+            }
+            return NULL;
+        }
+
+        if ( oconf->debug ) {
+            if ( pm ) {
+                fprintf( stderr, "zpopulator: Reused parameter, level: %d, locallevel: %d, unset: %d, unsetfn: %p\n",
+                        pm->level, locallevel, pm->node.flags & PM_UNSET ? 1 : 0, pm->gsu.s->unsetfn );
+                if ( pm->old ) {
+                    fprintf( stderr, "zpopulator: There is pm->old, level: %d\n", pm->old->level );
+                }
+                fflush( stderr );
+            }
+        }
+
+        /* Unset local has no table, it gets one below */
+        if ( pm->u.hash ) {
+            return pm;
+        }
+    }
+
+    if ( created && oconf->debug ) {
+        if ( pm ) {
+            fprintf( stderr, "zpopulator: Created parameter, level: %d, locallevel: %d, unset: %d, unsetfn: %p\n",
+                    pm->level, locallevel, pm->node.flags & PM_UNSET ? 1 : 0, pm->gsu.s->unsetfn );
+            if ( pm->old ) {
+                fprintf( stderr, "zpopulator: There is pm->old, level: %d\n", pm->old->level );
+            }
+            fflush( stderr );
+        }
+    }
+
+    /* This creates standard hash. However, it normally
+     * had getparamnode() call in getnode field, with
+     * PM_AUTOLOAD features - this is disabled here */
+    pm->u.hash = my_newparamtable( oconf->expected > 0 ? oconf->expected : 32, name );
+    if ( ! pm->u.hash ) {
+        if ( created ) {
+            paramtab->removenode( paramtab, name );
+            paramtab->freenode( &pm->node );
+        }
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: Out of memory when allocating hash\n" );
+        }
+        return NULL;
+    }
+
+    return pm;
+}
+
+static
+Param ensurethereisarray( char *name, struct outconf *oconf ) {
+    Param pm;
+
+    pm = (Param) paramtab->getnode( paramtab, name );
+    if ( ! pm ) {
+        pm = createparam( name, PM_ARRAY );
+        if ( ! pm ) {
+            return NULL;
+        }
+    } else {
+        if ( oconf->only_global && pm->level != 0 ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "Non-global variable `%s' exists, aborting (-g)\n", name );
+                fflush( stderr );
+            }
+            return NULL;
+        }
+
+        if ( PM_TYPE( pm->node.flags ) != PM_ARRAY || ( pm->node.flags & ( PM_SPECIAL | PM_READONLY ) ) ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "Variable `%s' isn't a plain array, aborting\n", name );
+                fflush( stderr );
+            }
+            return NULL;
+        }
+    }
+
+    if ( oconf->debug ) {
+        fprintf( stderr, "zpopulator: Array parameter, level: %d, locallevel: %d, unset: %d\n",
+                pm->level, locallevel, pm->node.flags & PM_UNSET ? 1 : 0 );
+        fflush( stderr );
+    }
+
+    return pm;
+}
+
+/* Makes room for one more element and the terminating NULL */
+static int
+arrbuild_reserve( struct arrbuild *b ) {
+    if ( b->count + 2 <= b->cap ) {
+        return 1;
+    }
+
+    int newcap = b->cap ? b->cap : ( b->expected > 64 ? b->expected + 1 : 64 );
+    while ( b->count + 2 > newcap ) {
+        newcap *= 2;
+    }
+
+    char **elems = (char **) realloc( b->elems, newcap * sizeof( char * ) );
+    COUNT_ALLOC();
+    if ( ! elems ) {
+        return 0;
+    }
+
+    b->elems = elems;
+    b->cap = newcap;
+    return 1;
+}
+
+/* Copy of the builder's elements, strings included, that
+ * the shell can free on its own - e.g. when the array is
+ * reassigned while the worker goes on */
+static char **
+arrbuild_copy( struct arrbuild *b ) {
+    char **copy = (char **) my_zalloc( ( b->count + 1 ) * sizeof( char * ) );
+    int i;
+
+    if ( ! copy ) {
+        return NULL;
+    }
+    for ( i = 0; i < b->count; i ++ ) {
+        if ( ! ( copy[ i ] = my_ztrdup( b->elems[ i ] ) ) ) {
+            break;
+        }
+    }
+    copy[ i ] = NULL;
+
+    return copy;
+}
+
+static void
+add_to_array( struct outconf *oconf, const char *value, int value_len ) {
+    struct arrbuild *b = &oconf->arr;
+
+    if ( ! arrbuild_reserve( b ) ) {
+        if ( ! oconf->silent ) {
+            fputs( "zpopulator: Out of memory when growing array\n", oconf->err );
+            fflush( oconf->err );
+        }
+        return;
+    }
+
+    STAGE_BEGIN( t0 );
+    char *elem = my_metafy_dup( value, value_len );
+    STAGE_END( STAGE_ALLOC, t0 );
+    if ( elem ) {
+        b->elems[ b->count ++ ] = elem;
+        STAT_ADD( oconf->worker->stats.inserted, 1 );
+    }
+}
+
+/* Makes current contents of the builder the value of
+ * target array. A batch (-b) publishes a copy, so that the
+ * shell owns every string it sees; when input ends, the
+ * builder's storage itself is handed over */
+static void
+publish_array( struct outconf *oconf, int final ) {
+    struct arrbuild *b = &oconf->arr;
+    Param pm = oconf->target_pm;
+    char **value;
+
+    if ( ! b->elems && ! arrbuild_reserve( b ) ) {
+        return;
+    }
+    b->elems[ b->count ] = NULL;
+
+    if ( final ) {
+        value = b->elems;
+        b->elems = NULL;
+        b->count = b->cap = 0;
+    } else if ( ! ( value = arrbuild_copy( b ) ) ) {
+        return;
+    }
+
+    /* Previous value, initial or a batch, is the
+     * shell's; it's freed whole by main thread */
+    char **old = pm->u.arr;
+    __atomic_store_n( &pm->u.arr, value, __ATOMIC_RELEASE );
+    if ( old ) {
+        retire( old, retired_freearray );
+    }
+}
+
+static void
+free_varcache_node( HashNode hn ) {
+    my_zsfree( hn->nam );
+    my_zfree( hn, sizeof( struct varcache ) );
+}
+
+static HashTable
+new_varcache() {
+    HashTable ht = my_newhashtable( 64, "zpopulator_varcache", NULL );
+    if ( ! ht ) {
+        return NULL;
+    }
+
+    ht->hash        = hasher;
+    ht->emptytable  = my_emptyhashtable;
+    ht->cmpnodes    = strcmp;
+    ht->addnode     = my_addhashnode;
+    ht->getnode     = my_gethashnode2;
+    ht->getnode2    = my_gethashnode2;
+    ht->removenode  = my_removehashnode;
+    ht->freenode    = free_varcache_node;
+
+    return ht;
+}
+
+static void
+delete_varcache( HashTable ht ) {
+    if ( ht ) {
+        ht->emptytable( ht );
+        my_zfree( ht->nodes, ht->hsize * sizeof( HashNode ) );
+        my_zfree( ht, sizeof( struct hashtable ) );
+    }
+}
+
+/* Finds global or current scope's parameter that can
+ * be set; NULL if there's no such parameter */
+static Param
+lookup_var( struct outconf *oconf, const char *name ) {
+    /* getnode2 doesn't autoload, and doesn't allocate */
+    Param pm = (Param) paramtab->getnode2( paramtab, name );
+
+    if ( pm ) {
+        if ( PM_TYPE( pm->node.flags ) != PM_SCALAR ||
+             ( pm->node.flags & ( PM_READONLY | PM_SPECIAL | PM_EXPORTED | PM_TIED | PM_UNSET ) ) ||
+             ( oconf->only_global && pm->level != 0 ) )
+        {
+            if ( oconf->debug ) {
+                fprintf( oconf->err, "zpopulator: Variable `%s' isn't a plain%s scalar, skipping it\n",
+                         name, oconf->only_global ? " global" : "" );
+                fflush( oconf->err );
+            }
+            pm = NULL;
+        }
+    } else if ( oconf->debug ) {
+        fprintf( oconf->err, "zpopulator: Variable `%s' doesn't exist, skipping it\n", name );
+        fflush( oconf->err );
+    }
+
+    return pm;
+}
+
+/* Finds parameter once per distinct name; later records
+ * reuse the cached Param. The shell can unset it, leave
+ * its scope, make it read-only or retype it meanwhile, so
+ * once per batch it's looked up and checked again */
+static Param
+resolve_var( struct outconf *oconf, const char *name ) {
+    struct varcache *vc = (struct varcache *) oconf->varcache->getnode( oconf->varcache, name );
+    if ( vc ) {
+        if ( vc->epoch != oconf->var_epoch ) {
+            vc->pm = lookup_var( oconf, name );
+            vc->epoch = oconf->var_epoch;
+        }
+        return vc->pm;
+    }
+
+    Param pm = lookup_var( oconf, name );
+
+    vc = (struct varcache *) my_zshcalloc( sizeof( struct varcache ) );
+    if ( vc ) {
+        vc->pm = pm;
+        vc->epoch = oconf->var_epoch;
+        oconf->varcache->addnode( oconf->varcache, my_ztrdup( name ), vc );
+    }
+
+    return pm;
+}
+
+static void
+set_var( struct outconf *oconf, const char *key_s, int key_len, const char *value, int value_len ) {
+    if ( key_len == 0 ) {
+        return;
+    }
+
+    char *key = metafy_keybuf( oconf, key_s, key_len, NULL );
+    if ( ! key ) {
+        return;
+    }
+
+    STAGE_BEGIN( t0 );
+    Param pm = resolve_var( oconf, key );
+    STAGE_END( STAGE_LOOKUP, t0 );
+    if ( ! pm ) {
+        return;
+    }
+
+    STAGE_BEGIN( t1 );
+    char *str = my_metafy_dup( value, value_len );
+    STAGE_END( STAGE_ALLOC, t1 );
+    if ( ! str ) {
+        return;
+    }
+
+    /* Shell can be expanding the variable right now */
+    char *old = pm->u.str;
+    __atomic_store_n( &pm->u.str, str, __ATOMIC_RELEASE );
+    if ( old ) {
+        retire( old, retired_free );
+    }
+    STAT_ADD( oconf->worker->stats.inserted, 1 );
+}
+
+static
+void set_in_hash( struct outconf *oconf, const char *key_s, int key_len, const char *value, int value_len ) {
+    if ( key_len == 0 ) {
+        return;
+    }
+
+    /* Metafied, null-terminated key, for the lookup */
+    int mkey_len;
+    char *key = metafy_keybuf( oconf, key_s, key_len, &mkey_len );
+    if ( ! key ) {
+        return;
+    }
+
+    /* Private table needs no getfn() - shell doesn't see it */
+    HashTable ht = oconf->ht ? oconf->ht : (HashTable) oconf->target_pm->gsu.h->getfn( oconf->target_pm );
+    if ( ! ht ) {
+        if ( oconf->debug ) {
+            fprintf( oconf->err, "zpopulator: Hash table `%s' is null\n", oconf->target );
+            fflush( oconf->err );
+        }
+        return;
+    }
+
+    /* Table created by this module - node, key and value
+     * are carved from the table's arena, the key's length
+     * is known so it's hashed without strlen() */
+    if ( is_zptable( ht ) ) {
+        struct zptable *zt = (struct zptable *) ht;
+        STAGE_BEGIN( t0 );
+        unsigned hashval = zp_memhash( key, mkey_len );
+        Param val_pm = (Param) zptable_lookup( zt, key, hashval );
+        STAGE_END( STAGE_LOOKUP, t0 );
+
+        /* Lazy value isn't copied, only referenced */
+        STAGE_BEGIN( t1 );
+        if ( ! val_pm ) {
+            struct zpparam *node = zptable_newnode( zt, key, mkey_len, hashval,
+                                                    oconf->lazy_data ? NULL : value, value_len );
+            if ( ! node ) {
+                return;
+            }
+            if ( oconf->lazy_data ) {
+                zptable_setlazy( node, value, value_len, oconf->lazy_cache );
+            }
+            zptable_insert( zt, node );
+        } else if ( ZPNODE_P( val_pm ) ) {
+            if ( oconf->lazy_data ) {
+                zptable_setlazy( (struct zpparam *) val_pm, value, value_len, oconf->lazy_cache );
+            } else {
+                zptable_setvalue( (struct zpparam *) val_pm, value, value_len );
+            }
+        } else {
+            my_strsetfn( val_pm, my_metafy_dup( value, value_len ) );
+        }
+        STAGE_END( STAGE_ALLOC, t1 );
+        STAT_ADD( oconf->worker->stats.inserted, 1 );
+        return;
+    }
+
+    STAGE_BEGIN( t0 );
+    Param val_pm = (Param) ht->getnode( ht, key );
+    STAGE_END( STAGE_LOOKUP, t0 );
+
+    /* Entry for key doesn't exist ? */
+    STAGE_BEGIN( t1 );
+    if ( ! val_pm ) {
+        val_pm = (Param) my_zshcalloc( sizeof (*val_pm) );
+        val_pm->node.flags = PM_SCALAR | PM_HASHELEM;
+	assigngetset(val_pm); // free of signal queueing
+
+        my_strsetfn( val_pm, my_metafy_dup( value, value_len ) );
+        ht->addnode( ht, my_ztrdup( key ), val_pm );
+    } else {
+        my_strsetfn( val_pm, my_metafy_dup( value, value_len ) );
+    }
+    STAGE_END( STAGE_ALLOC, t1 );
+    STAT_ADD( oconf->worker->stats.inserted, 1 );
+}
+
+static void
+show_help() {
+    printf( "Usage: zpin \"source_program\" | zpopulator [-a name [-b count]|-A name|-x|-q size] [-f file [-j count] [-l|-L|-I]|-c command|-u fds] [-M size] [-F format|-d string] [-J spec] [-D string] [-i name] [-T] [WORKER_ID]\n");
+    printf( "Options:\n" );
+    printf( " -a name - put input into global array `name'; array is set\n" );
+    printf( "           once, when input ends\n" );
+    printf( " -A name - put input into global hash `name', keys and values\n" );
+    printf( "           alternating\n" );
+    printf( " -x - put input into global variables, names and values determined\n" );
+    printf( "      as with hash (-d/-D); variables must already exist and be\n" );
+    printf( "      plain scalars - other names are skipped\n" );
+    printf( " -q size - queue records for zpread, worker waits when `size'\n" );
+    printf( "           records are queued and not read\n" );
+    printf( " -f file - read `file' instead of standard input; regular\n" );
+    printf( "           file is mapped into memory and parsed in place;\n" );
+    printf( "           the file must not be truncated while it's parsed,\n" );
+    printf( "           or, with -l/-L/-I, while the hash lives - the\n" );
+    printf( "           shell would be killed by SIGBUS; for a file that\n" );
+    printf( "           can change, use: zpopulator ... < file\n" );
+    printf( " -c command - start `command' and read its standard output,\n" );
+    printf( "              without forking the shell; words are separated\n" );
+    printf( "              by $IFS characters, empty words are dropped,\n" );
+    printf( "              backslash quotes a separator; it runs in its\n" );
+    printf( "              own process group, so ^C and ^Z typed at the\n" );
+    printf( "              prompt don't reach it\n" );
+    printf( " -u fds - read descriptors `fds', e.g. \"5 6 7=other\", all in\n" );
+    printf( "          one thread, as they become readable; \"fd=name\" puts\n" );
+    printf( "          fd's records into `name' instead of -a or -A target,\n" );
+    printf( "          descriptors with the same target share it\n" );
+    printf( " -M size - bound of input buffer, in bytes, k, m or g (at\n" );
+    printf( "           least 128k); longer records are dropped. With -A\n" );
+    printf( "           and -p, and a stream, also bound of the hash: input\n" );
+    printf( "           past `size' goes to a temporary file that is then\n" );
+    printf( "           mapped, values stay in it as with -l. Other targets\n" );
+    printf( "           can't refer to the file, there -M bounds only the\n" );
+    printf( "           input buffer\n" );
+    printf( " -j count - with -f and -a or -A, parse mapped file in `count'\n" );
+    printf( "            parallel ranges, merged in input order at end\n" );
+    printf( " -l - with -f, -A and -p, values stay in the mapped file and\n" );
+    printf( "      are copied only when shell reads them; the file must not\n" );
+    printf( "      be truncated while the hash is in use\n" );
+    printf( " -L - as -l, but value is copied on every read, not kept\n" );
+    printf( " -I - with -f and -A, replace `name' with a read-only index\n" );
+    printf( "      over the mapped file; elements are created only when\n" );
+    printf( "      read; later -A on `name' requires -p or -I\n" );
+    printf( " -d string - main delimeter dividing into array elements (default: \"\\n\")\n" );
+    printf( " -D string - sub-delimeter, to divide into key and value (default: \":\")\n" );
+    printf( "           delimeters can hold any bytes, e.g. -d $'\\0'\n" );
+    printf( " -F format - frame records without scanning for -d:\n" );
+    printf( "   nul - fields end with NUL byte, as with find -print0\n" );
+    printf( "   net - fields are netstrings, e.g. \"5:hello,\"\n" );
+    printf( "   len - fields are a 32-bit big-endian length and the bytes\n" );
+    printf( "   fixed:W - records are `W' bytes, split by -D with -A or -x\n" );
+    printf( "   fixed:K:V - records are a `K'-byte key padded with spaces\n" );
+    printf( "               or NULs, and a `V'-byte value; with -a or -q\n" );
+    printf( "               the whole record is stored\n" );
+    printf( "   With -A or -x, nul, net and len fields alternate between\n" );
+    printf( "   key and value; values can hold any bytes. -j and -I need\n" );
+    printf( "   delimeters and are ignored; -J can't be used\n" );
+    printf( " -J spec - each record (line) is a JSON object; strings are\n" );
+    printf( "           decoded, other values stored as JSON text:\n" );
+    printf( "   . - with -A or -x, store every member of the object\n" );
+    printf( "   keypath=valuepath - with -A or -x, store value at\n" );
+    printf( "       `valuepath' under key at `keypath', e.g. id=user.name\n" );
+    printf( "   path - with -a or -q, value at `path'; \".\" is the object\n" );
+    printf( "   Lines without the paths are skipped; -D, -I and -l don't\n" );
+    printf( "   apply\n" );
+    printf( " -p - with -A, fill a new hash privately and replace contents\n" );
+    printf( "      of `name' with it in one step when input ends\n" );
+    printf( " -n count - expected number of records, to size new hash or\n" );
+    printf( "            array up front; at most %d is used, beyond that\n", EXPECTED_MAX );
+    printf( "            they grow as records come\n" );
+    printf( " -b count - with -a, set the array also after every `count'\n" );
+    printf( "            records, not only when input ends\n" );
+    printf( " -g - ensure that there are only global variables in use - saves\n" );
+    printf( "      disappointments when learning that output variable must\n" );
+    printf( "      continuously live during computation\n" );
+    printf( " -i name - parameter to receive worker ID (default: REPLY)\n" );
+    printf( " -T - time each stage of the worker loop: read, scan, split,\n" );
+    printf( "      lookup, alloc and move; see zpstats -h\n" );
+    printf( " WORKER_ID - worker slot to use; by default first free slot\n" );
+    printf( "             is chosen; there are at most %d slots\n", WORKERS_MAX );
+    printf( "\n$zpworker_fd[WORKER_ID] becomes readable when the worker\n" );
+    printf( "finishes, e.g.: zselect -r $zpworker_fd[$REPLY]\n" );
+    printf( "$zpworker_stats[WORKER_ID] holds counters of the worker's\n" );
+    printf( "last run: bytes=, records= (parsed), inserted=, hiwater=\n" );
+    printf( "(buffer size), allocs= (heap allocations), elapsed=\n" );
+    printf( "(seconds) and rate= (bytes/s)\n" );
+    fflush( stdout );
+}
+
+static void
+show_help_zpwait() {
+    printf( "Usage: zpwait [-t timeout] [-a|-o] WORKER_ID ...\n");
+    printf( "Options:\n" );
+    printf( " -t timeout - give up after `timeout' seconds (fractions allowed)\n" );
+    printf( " -a - wait until all given workers finish (default)\n" );
+    printf( " -o - wait until at least one of given workers finishes\n" );
+    printf( "\nFinished workers are joined and reported in array $reply,\n" );
+    printf( "one element per worker: \"ID:status:records:error\", error\n" );
+    printf( "being empty on success. Returns 0 if all reported workers\n" );
+    printf( "succeeded, 1 if any failed, 2 on timeout.\n" );
+    fflush( stdout );
+}
+
+static void
+show_help_zpread() {
+    printf( "Usage: zpread [-n max] [-t timeout] WORKER_ID arrayname\n");
+    printf( "       zpread -c WORKER_ID\n");
+    printf( "Options:\n" );
+    printf( " -n max - take at most `max' records (default: all queued)\n" );
+    printf( " -t timeout - give up after `timeout' seconds (fractions allowed)\n" );
+    printf( " -c - cancel the queue: records are dropped, worker stops\n" );
+    printf( "      waiting for room and ends with error \"cancelled\"\n" );
+    printf( "\nTakes records queued by worker started with zpopulator -q,\n" );
+    printf( "waiting until there is at least one. Returns 0 if records\n" );
+    printf( "were read, 1 when the worker has finished and all records\n" );
+    printf( "were read, 2 on timeout.\n" );
+    fflush( stdout );
+}
+
+static void
+show_help_zpstats() {
+    printf( "Usage: zpstats [WORKER_ID ...]\n");
+    printf( "\nPrints, for each given worker (default: all) started with\n" );
+    printf( "zpopulator -T, time spent in each stage of its last run:\n" );
+    printf( " read - read() of input\n" );
+    printf( " scan - search for main delimeter\n" );
+    printf( " split - search for sub-delimeter, copying of key\n" );
+    printf( " lookup - search of hash or variable, indexing of key\n" );
+    printf( " alloc - creation of element and copying of value\n" );
+    printf( " move - growing of input buffer, moving of partial record\n" );
+    printf( "Columns are: calls, milliseconds, nanoseconds per call and\n" );
+    printf( "share of the run's elapsed time; with -j, threads add up.\n" );
+    fflush( stdout );
+}
+
+static void
+show_help_zpin() {
+    printf( "Usage: zpin \"<zsh code>\" | zpopulator ... [WORKER_ID]\n");
+    fflush( stdout );
+}
+
+static
+void free_oconf( struct outconf *oconf ) {
+    if ( oconf ) {
+        if ( oconf->nsources ) {
+            free_sources( oconf, 0 );
+        } else if ( ! oconf->stream && oconf->in_fd != -1 ) {
+            zclose( oconf->in_fd );
+        } else if ( NULL == oconf->stream || fileno( oconf->stream ) == -1 ) {
+            int file = oconf->stream ? fileno( oconf->stream ) : 0;
+            fprintf( oconf->err, "zpopulator: Input fail: %p (%d), %s\n", oconf->stream, file, strerror( errno ) );
+            fflush( oconf->err );
+        } else {
+            if ( -1 != fcntl( fileno( oconf->stream ), F_GETFD ) ) {
+                /* fclose: "dissociates the named stream from
+                 * its underlying file or set of functions"
+                 */
+                if ( 0 != fclose( oconf->stream ) ) {
+                    fprintf( oconf->err, "zpopulator: Warning: could not close input stream (%p): %s\n", oconf->stream, strerror( errno ) );
+                    fflush( oconf->err );
+                    /* TODO */
+                }
+            }
+        }
+
+        if ( -1 != fcntl( fileno( oconf->err ), F_GETFD ) ) {
+            if ( 0 != fclose( oconf->err ) ) {
+                /* TODO */
+            }
+        }
+
+        if ( oconf->spill_fd != -1 ) {
+            zclose( oconf->spill_fd );
+        }
+        if ( oconf->target ) {
+            zsfree( oconf->target );
+        }
+        if ( oconf->main_d.str ) {
+            zsfree( oconf->main_d.str );
+        }
+        if ( oconf->sub_d.str ) {
+            zsfree( oconf->sub_d.str );
+        }
+        if ( oconf->keybuf ) {
+            zsfree( oconf->keybuf );
+        }
+        free_jpath( &oconf->jkey );
+        free_jpath( &oconf->jval );
+        if ( oconf->file ) {
+            zsfree( oconf->file );
+        }
+        zfree( oconf, sizeof( struct outconf ) );
+    }
+}
+
+static
+void free_oconf_thread_safe( struct outconf *oconf ) {
+    if ( oconf ) {
+        if ( oconf->nsources ) {
+            /* Normally done by fan_in() already */
+            free_sources( oconf, 1 );
+        } else if ( ! oconf->stream && oconf->in_fd != -1 ) {
+            hand_back_fd( oconf->worker, oconf->in_fd );
+        } else if ( NULL == oconf->stream || fileno( oconf->stream ) == -1 ) {
+            int file = oconf->stream ? fileno( oconf->stream ): 0;
+            fprintf( oconf->err, "zpopulator: (thread) Input fail: %p (%d), %s\n", oconf->stream, file, strerror( errno ) );
+            fflush( oconf->err );
+        } else {
+            if ( -1 != fcntl( fileno( oconf->stream ), F_GETFD ) ) {
+                /* fclose: "dissociates the named stream from
+                 * its underlying file or set of functions"
+                 */
+                if ( 0 != fclose( oconf->stream ) ) {
+                    fprintf( oconf->err, "zpopulator: (thread) Warning: could not close input stream (%p): %s\n", oconf->stream, strerror( errno ) );
+                    fflush( oconf->err );
+                    /* TODO */
+                }
+            }
+        }
+
+        if ( -1 != fcntl( fileno( oconf->err ), F_GETFD ) ) {
+            if ( 0 != fclose( oconf->err ) ) {
+                /* TODO */
+            }
+        }
+
+        if ( oconf->spill_fd != -1 ) {
+            hand_back_fd( oconf->worker, oconf->spill_fd );
+        }
+        if ( oconf->target ) {
+            my_zsfree( oconf->target );
+        }
+        if ( oconf->main_d.str ) {
+            my_zsfree( oconf->main_d.str );
+        }
+        if ( oconf->sub_d.str ) {
+            my_zsfree( oconf->sub_d.str );
+        }
+        if ( oconf->keybuf ) {
+            my_zsfree( oconf->keybuf );
+        }
+        free_jbufs( oconf );
+        free_jpath( &oconf->jkey );
+        free_jpath( &oconf->jval );
+        if ( oconf->file ) {
+            my_zsfree( oconf->file );
+        }
+        my_zfree( oconf, sizeof( struct outconf ) );
+    }
+}
+
+/* Replaces target hash's table with the privately
+ * filled one; the old table is freed by main thread */
+static void
+publish_hash( struct outconf *oconf ) {
+    Param pm = oconf->target_pm;
+    HashTable old = pm->u.hash;
+
+    __atomic_store_n( &pm->u.hash, oconf->ht, __ATOMIC_RELEASE );
+    oconf->ht = NULL;
+
+    if ( old ) {
+        retire( old, retired_deleteparamtable );
+    }
+}
+
+/* Stores an array element, or queues a record for zpread */
+static void
+store_element( struct outconf *oconf, const char *rec, int len ) {
+    if ( oconf->mode == OUTPUT_ARRAY ) {
+        add_to_array( oconf, rec, len );
+        if ( oconf->batch > 0 && oconf->arr.count % oconf->batch == 0 ) {
+            publish_array( oconf, 0 );
+        }
+    } else if ( oconf->mode == OUTPUT_QUEUE ) {
+        STAGE_BEGIN( t0 );
+        char *str = my_metafy_dup( rec, len );
+        STAGE_END( STAGE_ALLOC, t0 );
+        if ( str ) {
+            if ( queue_push( oconf->worker->queue, str ) ) {
+                STAT_ADD( oconf->worker->stats.inserted, 1 );
+            } else {
+                my_zsfree( str );
+                oconf->worker->error = "cancelled";
+            }
+        }
+    }
+}
+
+/* Stores key and value in hash or variable mode */
+static void
+store_pair( struct outconf *oconf, const char *key, int klen, const char *val, int vlen ) {
+    if ( oconf->mode == OUTPUT_HASH ) {
+        set_in_hash( oconf, key, klen, val, vlen );
+    } else {
+        set_var( oconf, key, klen, val, vlen );
+    }
+}
+
+/* Stores a line of JSON Lines input, for -J */
+static void
+handle_json( struct outconf *oconf, const char *rec, int len ) {
+    struct jscan js = { rec, rec + len };
+    const char *key, *val;
+    int klen, vlen;
+
+    json_ws( &js );
+    if ( js.p == js.end ) {
+        return;
+    }
+
+    /* Members of a flat object */
+    if ( oconf->json == JSON_FLAT ) {
+        if ( ! json_expect( &js, '{' ) ) {
+            json_error( oconf, rec, len );
+            return;
+        }
+        if ( json_expect( &js, '}' ) ) {
+            return;
+        }
+        do {
+            json_ws( &js );
+            if ( js.p >= js.end || *js.p != '"' ||
+                 ! json_string( &js, &oconf->jbufs[ 0 ], &key, &klen ) ||
+                 ! json_expect( &js, ':' ) ||
+                 ! json_value( &js, &oconf->jbufs[ 1 ], &val, &vlen ) )
+            {
+                json_error( oconf, rec, len );
+                return;
+            }
+            store_pair( oconf, key, klen, val, vlen );
+        } while ( json_expect( &js, ',' ) );
+
+        if ( ! json_expect( &js, '}' ) ) {
+            json_error( oconf, rec, len );
+        }
+        return;
+    }
+
+    /* Values at given paths; lines without them are skipped */
+    if ( oconf->mode == OUTPUT_HASH || oconf->mode == OUTPUT_VARS ) {
+        if ( ! json_find( oconf, &js, &oconf->jkey ) || ! json_value( &js, &oconf->jbufs[ 0 ], &key, &klen ) ) {
+            return;
+        }
+        js.p = rec;
+    }
+    if ( ! json_find( oconf, &js, &oconf->jval ) || ! json_value( &js, &oconf->jbufs[ 1 ], &val, &vlen ) ) {
+        return;
+    }
+
+    if ( oconf->mode == OUTPUT_HASH || oconf->mode == OUTPUT_VARS ) {
+        store_pair( oconf, key, klen, val, vlen );
+    } else {
+        store_element( oconf, val, vlen );
+    }
+}
+
+/* Stores one record, `len' bytes at `rec' */
+static
+void handle_record( struct outconf *oconf, const char *rec, int len ) {
+    STAT_ADD( oconf->worker->stats.records, 1 );
+
+    if ( oconf->json ) {
+        handle_json( oconf, rec, len );
+        return;
+    }
+
+    /**/
+    /* Will have to split one more time if OUTPUT_HASH */
+    /**/
+
+    if ( oconf->mode == OUTPUT_HASH ) {
+        const char *sfound = split_delim( oconf, rec, len );
+        if ( ! sfound ) {
+            set_in_hash( oconf, rec, len, "", 0 );
+        } else {
+            /* Store left side as key, right side as data */
+            int key_len = sfound - rec;
+            set_in_hash( oconf, rec, key_len, sfound + oconf->sub_d.len, len - key_len - oconf->sub_d.len );
+        }
+    } else
+
+    /**/
+    /* Just store for OUTPUT_ARRAY */
+    /**/
+
+    if ( oconf->mode == OUTPUT_ARRAY ) {
+        store_element( oconf, rec, len );
+    } else
+
+    /**/
+    /* Create variable for every key (string before sub-delimeter) */
+    /**/
+
+    if ( oconf->mode == OUTPUT_VARS ) {
+        const char *sfound = split_delim( oconf, rec, len );
+        if ( sfound ) {
+            int key_len = sfound - rec;
+            set_var( oconf, rec, key_len, sfound + oconf->sub_d.len, len - key_len - oconf->sub_d.len );
+        }
+    } else
+
+    /**/
+    /* Hand over to zpread for OUTPUT_QUEUE */
+    /**/
+
+    if ( oconf->mode == OUTPUT_QUEUE ) {
+        store_element( oconf, rec, len );
+    }
+}
+
+/* Stores a unit of framed input */
+static void
+handle_frame( struct outconf *oconf, struct frame *fr ) {
+    if ( ! fr->key ) {
+        handle_record( oconf, fr->val, fr->vlen );
+        return;
+    }
+
+    STAT_ADD( oconf->worker->stats.records, 1 );
+    if ( oconf->mode == OUTPUT_HASH ) {
+        set_in_hash( oconf, fr->key, fr->klen, fr->val, fr->vlen );
+    } else {
+        set_var( oconf, fr->key, fr->klen, fr->val, fr->vlen );
+    }
+}
+
+/* Lets main thread return from bin_zpopulator() */
+static void
+signal_started( struct outconf *oconf ) {
+    struct startup *st = oconf->startup;
+
+    pthread_mutex_lock( &st->mutex );
+    st->started = 1;
+    pthread_cond_signal( &st->cond );
+    pthread_mutex_unlock( &st->mutex );
+
+    /* Main thread's stack frame can be gone from now on */
+    oconf->startup = NULL;
+}
+
+/* Every exit of worker thread goes through this */
+static void *
+finish_worker( struct outconf *oconf, int *ret ) {
+    struct worker *w = oconf->worker;
+
+    w->status = *ret;
+    free_oconf_thread_safe( oconf );
+
+    STAT_SET( w->stats.end_ns, now_ns() );
+
+    /* Mark the thread as not working; the release store
+     * of `state' publishes `status' and `finished' */
+    __atomic_store_n( &w->finished[ 0 ], '1', __ATOMIC_RELAXED );
+    __atomic_store_n( &w->state, WORKER_FINISHED, __ATOMIC_RELEASE );
+
+    /* Lower general workers counter */
+    __atomic_fetch_sub( &workers_count, 1, __ATOMIC_RELAXED );
+
+    /* Wake up anyone waiting on $zpworker_fd */
+    int wfd = w->wfd;
+    w->wfd = -1;
+    if ( write( wfd, "1", 1 ) == -1 ) {
+        /* Closing alone makes the fd readable, too */
+    }
+    close( wfd );
+
+    pthread_exit( ret );
+    return ret;
+}
+
+/* Input buffer of a stream. It's a window: records are
+ * consumed by advancing `start', the partial record after
+ * them is moved to the beginning only when there's no room
+ * left for the next read - not after every read */
+struct inbuf {
+    char *buf;
+    int size;
+    /* Offset of the first byte not yet consumed */
+    int start;
+    /* Number of bytes in `buf' */
+    int index;
+    /* Offset from which the main delimeter is searched for.
+     * Bytes before it are known not to start a delimeter,
+     * so each byte of input is inspected once. */
+    int scan;
+    /* Set after a record outgrew -M: bytes up to the next
+     * main delimeter are dropped */
+    int skip;
+};
+
+static void
+note_hiwater( struct outconf *oconf, long size ) {
+    if ( size > STAT_GET( oconf->worker->stats.hiwater ) ) {
+        STAT_SET( oconf->worker->stats.hiwater, size );
+    }
+}
+
+static int
+inbuf_init( struct outconf *oconf, struct inbuf *ib ) {
+    ib->size = 256;
+    ib->start = 0;
+    ib->index = 0;
+    ib->scan = 0;
+    ib->skip = 0;
+    ib->buf = malloc( ib->size );
+    COUNT_ALLOC();
+    if ( ! ib->buf ) {
+        if ( ! oconf->silent ) {
+            fputs( "zpopulator: Out of memory in thread", oconf->err );
+            fflush( oconf->err );
+        }
+        oconf->worker->error = "memory";
+        return 0;
+    }
+    note_hiwater( oconf, ib->size );
+    return 1;
+}
+
+static void
+inbuf_free( struct inbuf *ib ) {
+    if ( ib->buf ) {
+        free( ib->buf );
+        ib->buf = NULL;
+    }
+}
+
+/* Makes room for `read_size' more bytes after `index', or
+ * for less under -M. Returns 0 when out of memory, -1 when
+ * the buffer holds a partial record as long as the bound */
+static int
+inbuf_reserve( struct outconf *oconf, struct inbuf *ib, int read_size ) {
+    if ( ib->index + read_size <= ib->size ) {
+        return 1;
+    }
+
+    /* Window reached the end - drop consumed bytes */
+    if ( ib->start > 0 ) {
+        STAGE_BEGIN( t0 );
+        memmove( ib->buf, ib->buf + ib->start, ib->index - ib->start );
+        STAGE_END( STAGE_MOVE, t0 );
+        ib->index -= ib->start;
+        ib->scan -= ib->start;
+        ib->start = 0;
+        if ( ib->index + read_size <= ib->size ) {
+            return 1;
+        }
+    }
+
+    /* Room for several reads, so that the partial
+     * record is moved once per few reads */
+    int bufsize = ib->size;
+    while ( ib->index + 4 * read_size > bufsize ) {
+        bufsize *= 1.5;
+    }
+    if ( oconf->limit && bufsize > oconf->limit ) {
+        bufsize = oconf->limit > ib->size ? oconf->limit : ib->size;
+        if ( ib->index >= bufsize ) {
+            return -1;
+        }
+        if ( bufsize == ib->size ) {
+            return 1;
+        }
+    }
+    COUNT_ALLOC();
+    STAGE_BEGIN( t0 );
+    char *buf = realloc( ib->buf, bufsize );
+    STAGE_END( STAGE_MOVE, t0 );
+    if ( ! buf ) {
+        fprintf( oconf->err, "zpopulator: Fatal error - could not reallocate buffer, lines are too long" );
+        fflush( oconf->err );
+        oconf->worker->error = "memory";
+        return 0;
+    }
+    ib->buf = buf;
+    ib->size = bufsize;
+    note_hiwater( oconf, bufsize );
+    return 1;
+}
+
+/* Reads once from `fd' into the buffer. Returns number
+ * of bytes read, 0 at end of input or on error */
+static int
+inbuf_read( struct outconf *oconf, struct inbuf *ib, int fd ) {
+    int count;
+
+    do {
+        STAGE_BEGIN( t0 );
+        count = read( fd, ib->buf + ib->index, ib->size - ib->index );
+        STAGE_END( STAGE_READ, t0 );
+    } while ( count == -1 && errno == EINTR );
+
+    if ( count == -1 ) {
+        fprintf( oconf->err, "zpopulator: Read error (descriptor: %d): %s\n", fd, strerror( errno ) );
+        fflush( oconf->err );
+        oconf->worker->error = "read";
+        count = 0;
+    }
+
+    ib->index += count;
+    STAT_ADD( oconf->worker->stats.bytes, count );
+    return count;
+}
+
+/* Drops partial record that reached -M, keeping only
+ * the bytes that can begin a main delimeter */
+static void
+inbuf_drop( struct outconf *oconf, struct inbuf *ib ) {
+    int keep = oconf->main_d.len - 1;
+
+    if ( ! ib->skip ) {
+        if ( ! oconf->silent ) {
+            fprintf( oconf->err, "zpopulator: Record longer than %ld bytes (-M), dropping %s\n", oconf->limit,
+                     oconf->framing ? "the rest of input" : "it" );
+            fflush( oconf->err );
+        }
+        oconf->worker->error = "limit";
+        ib->skip = 1;
+    }
+
+    if ( keep > ib->index - ib->start ) {
+        keep = ib->index - ib->start;
+    }
+    memmove( ib->buf, ib->buf + ib->index - keep, keep );
+    ib->start = 0;
+    ib->index = keep;
+    ib->scan = 0;
+}
+
+/* As inbuf_records(), for -F. Framing errors can't be
+ * recovered from, the rest of input is then dropped */
+static void
+inbuf_frames( struct outconf *oconf, struct inbuf *ib, int eof ) {
+    struct frame fr;
+    int start = ib->start;
+
+    while ( ! ib->skip && start < ib->index ) {
+        long count = next_frame( oconf, ib->buf + start, ib->index - start, eof, &fr );
+        if ( count > 0 ) {
+            handle_frame( oconf, &fr );
+            start += count;
+        } else if ( count == 0 && ! eof ) {
+            break;
+        } else {
+            frame_error( oconf );
+            ib->skip = 1;
+        }
+    }
+
+    if ( eof || ib->skip ) {
+        ib->start = ib->index = ib->scan = 0;
+    } else {
+        ib->start = ib->scan = start;
+    }
+}
+
+/* Stores every complete record that is in buffer, and at
+ * `eof' also the last one, which has no trailing delimeter */
+static void
+inbuf_records( struct outconf *oconf, struct inbuf *ib, int eof ) {
+    char *buf = ib->buf;
+    const char *found;
+    int main_d_len = oconf->main_d.len;
+    int start = ib->start;
+
+    ++ oconf->var_epoch;
+
+    if ( oconf->framing ) {
+        inbuf_frames( oconf, ib, eof );
+        return;
+    }
+
+    /* Rest of a dropped record */
+    if ( ib->skip ) {
+        found = scan_delim( oconf, buf + ib->scan, ib->index - ib->scan );
+        if ( ! found ) {
+            inbuf_drop( oconf, ib );
+            return;
+        }
+        start = ib->scan = ( found - buf ) + main_d_len;
+        ib->skip = 0;
+    }
+
+    while ( ( found = scan_delim( oconf, buf + ib->scan, ib->index - ib->scan ) ) ) {
+        handle_record( oconf, buf + start, found - ( buf + start ) );
+        start = ( found - buf ) + main_d_len;
+        ib->scan = start;
+    }
+
+    if ( eof ) {
+        if ( start < ib->index ) {
+            handle_record( oconf, buf + start, ib->index - start );
+        }
+        ib->start = ib->index = ib->scan = 0;
+        return;
+    }
+
+    /* Consumed bytes stay until inbuf_reserve() needs room */
+    ib->start = start;
+
+    /* Delimeter can still begin in its length-1 last bytes */
+    ib->scan = ib->index - main_d_len + 1;
+    if ( ib->scan < start ) {
+        ib->scan = start;
+    }
+}
+
+/* Writes whole `len' bytes to `fd' */
+static int
+write_all( int fd, const char *data, size_t len ) {
+    while ( len > 0 ) {
+        ssize_t count = write( fd, data, len );
+        if ( count == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return 0;
+        }
+        data += count;
+        len -= count;
+    }
+    return 1;
+}
+
+/* Past -M, copies the partial record and the rest of input
+ * to the spill file, then maps the file and parses it like
+ * -f input; hash values stay in the mapping as with -l */
+static void
+spill_input( struct outconf *oconf, struct inbuf *ib ) {
+    int fd = oconf->spill_fd, eof = 0;
+    size_t len = 0;
+
+    while ( 1 ) {
+        if ( ! write_all( fd, ib->buf + ib->start, ib->index - ib->start ) ) {
+            fprintf( oconf->err, "zpopulator: Couldn't write to spill file: %s\n", strerror( errno ) );
+            fflush( oconf->err );
+            oconf->worker->error = "spill";
+            return;
+        }
+        len += ib->index - ib->start;
+        ib->start = ib->index = ib->scan = 0;
+        if ( eof || ! inbuf_reserve( oconf, ib, READ_SIZE ) ) {
+            break;
+        }
+        eof = inbuf_read( oconf, ib, oconf->in_fd ) == 0;
+    }
+
+    if ( len == 0 ) {
+        return;
+    }
+    void *data = mmap( NULL, len, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( data == MAP_FAILED ) {
+        fprintf( oconf->err, "zpopulator: Couldn't map spill file: %s\n", strerror( errno ) );
+        fflush( oconf->err );
+        oconf->worker->error = "spill";
+        return;
+    }
+
+    /* Index would replace records stored before the spill */
+    if ( oconf->index && oconf->ht && oconf->ht->ct > 0 ) {
+        oconf->index = 0;
+    }
+    oconf->lazy = 1;
+    parse_mapping( oconf, data, len );
+}
+
+/* Memory that input occupies now - the buffer, and the
+ * private table's nodes, keys and values */
+static long
+held_bytes( struct outconf *oconf, struct inbuf *ib ) {
+    long held = ib->size;
+
+    if ( oconf->ht && is_zptable( oconf->ht ) ) {
+        struct zptable *zt = (struct zptable *) oconf->ht;
+        held += zt->arena.bytes + zt->cap * sizeof( HashNode );
+    }
+    return held;
+}
+
+/* Reads input in blocks, storing every complete record
+ * of each block; used for pipes and other streams */
+static void
+read_input( struct outconf *oconf ) {
+    struct inbuf ib;
+    int ret;
+
+    if ( ! inbuf_init( oconf, &ib ) ) {
+        return;
+    }
+
+    while ( ( ret = inbuf_reserve( oconf, &ib, READ_SIZE ) ) ) {
+        if ( oconf->worker->queue && queue_cancelled( oconf->worker->queue ) ) {
+            break;
+        }
+
+        /* Long record, or more input than -M allows to
+         * hold in memory - the rest goes to spill file */
+        if ( oconf->spill_fd != -1 && ( ret == -1 || held_bytes( oconf, &ib ) > oconf->limit ) ) {
+            spill_input( oconf, &ib );
+            break;
+        }
+        if ( ret == -1 ) {
+            inbuf_drop( oconf, &ib );
+            continue;
+        }
+
+        /* Zero-read or error -> no more data will come */
+        int eof = inbuf_read( oconf, &ib, oconf->in_fd ) == 0;
+
+        /* No data in buffer, and stream is ended -> break */
+        if ( eof && ib.index == 0 ) {
+            break;
+        }
+
+        inbuf_records( oconf, &ib, eof );
+        if ( eof ) {
+            break;
+        }
+    }
+
+    inbuf_free( &ib );
+}
+
+/* Stores every record of mapped input, in place. The
+ * last record doesn't need a trailing delimeter */
+static void
+split_mapped( struct outconf *oconf, const char *data, size_t len ) {
+    const char *p = data, *end = data + len, *found;
+
+    ++ oconf->var_epoch;
+
+    if ( oconf->framing ) {
+        struct frame fr;
+        while ( p < end ) {
+            long count = next_frame( oconf, p, end - p, 1, &fr );
+            if ( count <= 0 ) {
+                frame_error( oconf );
+                break;
+            }
+            handle_frame( oconf, &fr );
+            p += count;
+        }
+        return;
+    }
+
+    while ( ( found = scan_delim( oconf, p, end - p ) ) ) {
+        handle_record( oconf, p, found - p );
+        p = found + oconf->main_d.len;
+    }
+
+    if ( p < end ) {
+        handle_record( oconf, p, end - p );
+    }
+}
+
+/* Record of index, its value follows the key and
+ * the sub-delimeter; `vlen' is 0 when there's none */
+struct zpentry {
+    size_t off;
+    unsigned hashval;
+    int klen;
+    int vlen;
+};
+
+/* Read-only hash table over a retained input mapping,
+ * for -I. Entries are found by open addressing, Params
+ * are created only for keys that shell reads */
+struct zpindex {
+    struct hashtable ht;
+    const char *data;
+    size_t len;
+    int sublen;
+    struct zpentry *ents;
+    int count;
+    int cap;
+    /* Entry index + 1, 0 for free slot */
+    unsigned *slots;
+    unsigned mask;
+};
+
+static int
+is_zpindex( HashTable ht ) {
+    return ht->emptytable == zpindex_emptytable;
+}
+
+/* Slot holding entry with given raw key, or a free one */
+static unsigned *
+zpindex_slot( struct zpindex *zi, const char *key, int klen, unsigned hashval ) {
+    unsigned i = hashval & zi->mask;
+
+    while ( zi->slots[ i ] ) {
+        struct zpentry *e = &zi->ents[ zi->slots[ i ] - 1 ];
+        if ( e->hashval == hashval && e->klen == klen && 0 == memcmp( zi->data + e->off, key, klen ) ) {
+            break;
+        }
+        i = ( i + 1 ) & zi->mask;
+    }
+
+    return &zi->slots[ i ];
+}
+
+/* Keeps load of slots at most 1/2 */
+static int
+zpindex_grow( struct zpindex *zi ) {
+    unsigned size = ( zi->mask + 1 ) * 2, i;
+    unsigned *slots = (unsigned *) my_zshcalloc( size * sizeof( unsigned ) );
+
+    if ( ! slots ) {
+        return 0;
+    }
+    for ( i = 0; i < (unsigned) zi->count; i ++ ) {
+        unsigned j = zi->ents[ i ].hashval & ( size - 1 );
+        while ( slots[ j ] ) {
+            j = ( j + 1 ) & ( size - 1 );
+        }
+        slots[ j ] = i + 1;
+    }
+
+    my_zfree( zi->slots, ( zi->mask + 1 ) * sizeof( unsigned ) );
+    zi->slots = slots;
+    zi->mask = size - 1;
+    return 1;
+}
+
+/* Later record with same key replaces the earlier one */
+static int
+zpindex_add( struct zpindex *zi, const char *rec, int klen, int vlen ) {
+    unsigned hashval = zp_memhash( rec, klen );
+    unsigned *slot = zpindex_slot( zi, rec, klen, hashval );
+    struct zpentry *e;
+
+    if ( *slot ) {
+        e = &zi->ents[ *slot - 1 ];
+        e->off = rec - zi->data;
+        e->vlen = vlen;
+        return 1;
+    }
+
+    if ( zi->count == zi->cap ) {
+        int cap = zi->cap * 2;
+        struct zpentry *ents = (struct zpentry *) realloc( zi->ents, cap * sizeof( struct zpentry ) );
+        COUNT_ALLOC();
+        if ( ! ents ) {
+            return 0;
+        }
+        zi->ents = ents;
+        zi->cap = cap;
+    }
+
+    e = &zi->ents[ zi->count ++ ];
+    e->off = rec - zi->data;
+    e->hashval = hashval;
+    e->klen = klen;
+    e->vlen = vlen;
+    *slot = zi->count;
+
+    if ( (unsigned) zi->count * 2 > zi->mask + 1 ) {
+        return zpindex_grow( zi );
+    }
+    return 1;
+}
+
+/* Transient Param of entry, on the heap of current
+ * expansion; NULL entry gives an unset element */
+static Param
+zpindex_param( struct zpindex *zi, struct zpentry *e, const char *name, Param pm ) {
+    if ( ! pm ) {
+        pm = (Param) hcalloc( sizeof( struct param ) );
+    }
+    pm->node.flags = PM_SCALAR | PM_HASHELEM | PM_READONLY;
+    pm->gsu.s = &nullsetscalar_gsu;
+
+    if ( name ) {
+        pm->node.nam = dupstring( name );
+    } else {
+        pm->node.nam = (char *) zhalloc( metafied_len( zi->data + e->off, e->klen ) + 1 );
+        metafy_copy( pm->node.nam, zi->data + e->off, e->klen );
+    }
+
+    if ( e ) {
+        const char *value = zi->data + e->off + e->klen + zi->sublen;
+        pm->u.str = (char *) zhalloc( metafied_len( value, e->vlen ) + 1 );
+        metafy_copy( pm->u.str, value, e->vlen );
+    } else {
+        pm->u.str = dupstring( "" );
+        pm->node.flags |= PM_UNSET;
+    }
+
+    return pm;
+}
+
+static HashNode
+zpindex_getnode( HashTable ht, const char *name ) {
+    struct zpindex *zi = (struct zpindex *) ht;
+    struct zpentry *e = NULL;
+    int klen;
+
+    /* Keys are looked up in raw input */
+    char *key = unmetafy( dupstring( name ), &klen );
+    if ( zi->count ) {
+        unsigned *slot = zpindex_slot( zi, key, klen, zp_memhash( key, klen ) );
+        if ( *slot ) {
+            e = &zi->ents[ *slot - 1 ];
+        }
+    }
+
+    return &zpindex_param( zi, e, name, NULL )->node;
+}
+
+static void
+zpindex_scan( HashTable ht, ScanFunc func, int flags ) {
+    struct zpindex *zi = (struct zpindex *) ht;
+    struct param pm;
+    unsigned i;
+
+    for ( i = 0; zi->count && i <= zi->mask; i ++ ) {
+        if ( ! zi->slots[ i ] ) {
+            continue;
+        }
+        memset( &pm, 0, sizeof( pm ) );
+        zpindex_param( zi, &zi->ents[ zi->slots[ i ] - 1 ], NULL, &pm );
+        func( &pm.node, flags );
+    }
+}
+
+/* Frees the index and unmaps the input */
+static void
+zpindex_emptytable( HashTable ht ) {
+    struct zpindex *zi = (struct zpindex *) ht;
+
+    if ( zi->data ) {
+        munmap( (void *) zi->data, zi->len );
+        zi->data = NULL;
+    }
+    free( zi->ents );
+    zi->ents = NULL;
+    my_zfree( zi->slots, ( zi->mask + 1 ) * sizeof( unsigned ) );
+    zi->slots = NULL;
+    zi->count = zi->cap = 0;
+    zi->mask = 0;
+    ht->ct = 0;
+}
+
+static void
+zpindex_ignore( void ) {
+}
+
+/* Builds index of mapped input, which it takes over */
+static HashTable
+build_index( struct outconf *oconf, const char *data, size_t len ) {
+    struct zpindex *zi;
+    HashTable ht;
+    const char *p = data, *end = data + len, *found;
+
+    ht = my_allochashtable( sizeof( struct zpindex ), 1, oconf->target, NULL );
+    if ( ! ht ) {
+        return NULL;
+    }
+    zi = (struct zpindex *) ht;
+    zi->data = data;
+    zi->len = len;
+    zi->sublen = oconf->sub_d.len;
+    zi->cap = oconf->expected > 64 ? oconf->expected : 64;
+    zi->ents = (struct zpentry *) malloc( zi->cap * sizeof( struct zpentry ) );
+    COUNT_ALLOC();
+    zi->mask = 127;
+    while ( zi->mask + 1 < (unsigned) zi->cap * 2 ) {
+        zi->mask = zi->mask * 2 + 1;
+    }
+    zi->slots = (unsigned *) my_zshcalloc( ( zi->mask + 1 ) * sizeof( unsigned ) );
+
+    ht->hash        = zp_hash;
+    ht->emptytable  = zpindex_emptytable;
+    ht->filltable   = NULL;
+    ht->cmpnodes    = strcmp;
+    ht->addnode     = (AddNodeFunc) zpindex_ignore;
+    ht->getnode     = zpindex_getnode;
+    ht->getnode2    = zpindex_getnode;
+    ht->removenode  = (RemoveNodeFunc) zpindex_ignore;
+    ht->disablenode = NULL;
+    ht->enablenode  = NULL;
+    ht->freenode    = (FreeNodeFunc) zpindex_ignore;
+    ht->printnode   = printparamnode;
+    ht->scantab     = zpindex_scan;
+
+    if ( ! zi->ents || ! zi->slots ) {
+        zi->data = NULL;
+        zpindex_emptytable( ht );
+        my_zfree( ht->nodes, sizeof( HashNode ) );
+        my_zfree( ht, sizeof( struct zpindex ) );
+        return NULL;
+    }
+
+    while ( p < end ) {
+        found = scan_delim( oconf, p, end - p );
+        int rlen = found ? found - p : end - p;
+
+        STAT_ADD( oconf->worker->stats.records, 1 );
+
+        const char *sfound = split_delim( oconf, p, rlen );
+        int klen = sfound ? sfound - p : rlen;
+        int vlen = sfound ? rlen - klen - zi->sublen : 0;
+        if ( klen > 0 ) {
+            STAGE_BEGIN( t0 );
+            int added = zpindex_add( zi, p, klen, vlen );
+            STAGE_END( STAGE_LOOKUP, t0 );
+            if ( ! added ) {
+                oconf->worker->error = "memory";
+                break;
+            }
+            STAT_ADD( oconf->worker->stats.inserted, 1 );
+        }
+
+        if ( ! found ) {
+            break;
+        }
+        p = found + oconf->main_d.len;
+    }
+
+    ht->ct = zi->count;
+    return ht;
+}
+
+/* Range of mapped input parsed by one thread, into its
+ * own table or array */
+struct chunk {
+    struct outconf oconf;
+    const char *data;
+    size_t len;
+    pthread_t thread;
+    int started;
+};
+
+/* Smallest range worth a thread of its own */
+#define CHUNK_MIN ( 1024 * 1024 )
+
+static void *
+parse_chunk( void *void_ptr ) {
+    struct chunk *c = (struct chunk *) void_ptr;
+    thread_stats = &c->oconf.worker->stats;
+    split_mapped( &c->oconf, c->data, c->len );
+    return NULL;
+}
+
+/* Stores chunk's table in target - nodes are moved, not
+ * copied, when target is a table of this module */
+static void
+merge_partial( struct outconf *oconf, struct zptable *part ) {
+    HashTable ht = oconf->ht ? oconf->ht : (HashTable) oconf->target_pm->gsu.h->getfn( oconf->target_pm );
+    HashNode hn, next;
+    int i;
+
+    if ( ht && is_zptable( ht ) ) {
+        zptable_merge( (struct zptable *) ht, part );
+        zptable_delete( &part->ht );
+        return;
+    }
+
+    for ( i = 0; ht && i < part->ht.hsize; i ++ ) {
+        for ( hn = part->ht.nodes[ i ]; hn; hn = next ) {
+            next = hn->next;
+            char *value = ( (Param) hn )->u.str;
+            Param val_pm = (Param) ht->getnode( ht, hn->nam );
+            if ( ! val_pm ) {
+                val_pm = (Param) my_zshcalloc( sizeof (*val_pm) );
+                val_pm->node.flags = PM_SCALAR | PM_HASHELEM;
+                assigngetset( val_pm );
+                my_strsetfn( val_pm, my_ztrdup( value ) );
+                ht->addnode( ht, my_ztrdup( hn->nam ), val_pm );
+            } else {
+                my_strsetfn( val_pm, my_ztrdup( value ) );
+            }
+        }
+    }
+    zptable_delete( &part->ht );
+}
+
+/* Appends chunk's elements, strings are taken over */
+static void
+merge_array( struct outconf *oconf, struct arrbuild *part ) {
+    struct arrbuild *b = &oconf->arr;
+    int i;
+
+    for ( i = 0; i < part->count; i ++ ) {
+        if ( ! arrbuild_reserve( b ) ) {
+            /* Out of memory, drop the rest */
+            for ( ; i < part->count; i ++ ) {
+                my_zsfree( part->elems[ i ] );
+            }
+            break;
+        }
+        b->elems[ b->count ++ ] = part->elems[ i ];
+    }
+    free( part->elems );
+}
+
+/* Splits mapped input into ranges that begin after a main
+ * delimeter, parses them concurrently and merges results
+ * in input order, so later records override earlier ones */
+static void
+parse_parallel( struct outconf *oconf, const char *data, size_t len ) {
+    int i, n = oconf->jobs;
+    size_t start = 0;
+
+    if ( (size_t) n > len / CHUNK_MIN + 1 ) {
+        n = len / CHUNK_MIN + 1;
+    }
+
+    struct chunk *chunks = (struct chunk *) my_zshcalloc( n * sizeof( struct chunk ) );
+    if ( ! chunks ) {
+        split_mapped( oconf, data, len );
+        return;
+    }
+
+    for ( i = 0; i < n; i ++ ) {
+        struct chunk *c = &chunks[ i ];
+        size_t end = len;
+
+        if ( i < n - 1 ) {
+            size_t b = len / n * ( i + 1 );
+            /* Delimeter can begin just before the boundary */
+            size_t from = b >= (size_t) oconf->main_d.len - 1 ? b - ( oconf->main_d.len - 1 ) : 0;
+            if ( from < start ) {
+                from = start;
+            }
+            const char *found = find_delim( &oconf->main_d, data + from, len - from );
+            end = found ? (size_t) ( found - data ) + oconf->main_d.len : len;
+        }
+
+        c->data = data + start;
+        c->len = end - start;
+        start = end;
+
+        c->oconf = *oconf;
+        c->oconf.keybuf = NULL;
+        c->oconf.keybuf_size = 0;
+        memset( c->oconf.jbufs, 0, sizeof( c->oconf.jbufs ) );
+        c->oconf.batch = 0;
+        memset( &c->oconf.arr, 0, sizeof( struct arrbuild ) );
+        c->oconf.arr.expected = oconf->expected / n;
+        if ( oconf->mode == OUTPUT_HASH ) {
+            c->oconf.ht = my_newparamtable( oconf->expected / n, oconf->target );
+            if ( ! c->oconf.ht ) {
+                c->len = 0;
+                oconf->worker->error = "memory";
+            }
+        }
+    }
+
+    /* First range is parsed by this thread */
+    for ( i = 1; i < n; i ++ ) {
+        if ( chunks[ i ].len ) {
+            chunks[ i ].started = ! pthread_create( &chunks[ i ].thread, NULL, parse_chunk, &chunks[ i ] );
+        }
+    }
+    for ( i = 0; i < n; i ++ ) {
+        if ( ! chunks[ i ].started ) {
+            parse_chunk( &chunks[ i ] );
+        }
+    }
+
+    for ( i = 0; i < n; i ++ ) {
+        struct chunk *c = &chunks[ i ];
+
+        if ( c->started ) {
+            pthread_join( c->thread, NULL );
+        }
+        if ( c->oconf.keybuf ) {
+            my_zsfree( c->oconf.keybuf );
+        }
+        free_jbufs( &c->oconf );
+
+        if ( oconf->mode == OUTPUT_HASH && c->oconf.ht ) {
+            /* Empty private table is replaced, not merged into */
+            if ( i == 0 && oconf->ht && oconf->ht->ct == 0 ) {
+                zptable_delete( oconf->ht );
+                oconf->ht = c->oconf.ht;
+            } else {
+                merge_partial( oconf, (struct zptable *) c->oconf.ht );
+            }
+        } else if ( oconf->mode == OUTPUT_ARRAY ) {
+            merge_array( oconf, &c->oconf.arr );
+        }
+    }
+
+    my_zfree( chunks, n * sizeof( struct chunk ) );
+}
+
+/* Parses mapped input, from -f or spilled by -M; the
+ * mapping is kept when lazy values or index refer to it */
+static void
+parse_mapping( struct outconf *oconf, void *data, size_t len ) {
+#ifdef MADV_SEQUENTIAL
+    madvise( data, len, MADV_SEQUENTIAL );
+#endif
+
+    /* Index replaces the private table, and keeps the
+     * mapping for lookups */
+    if ( oconf->index && oconf->mode == OUTPUT_HASH && ! oconf->framing && ! oconf->json ) {
+        HashTable ht = build_index( oconf, (const char *) data, len );
+        if ( ! ht ) {
+            oconf->worker->error = "memory";
+            munmap( data, len );
+            return;
+        }
+#ifdef MADV_RANDOM
+        madvise( data, len, MADV_RANDOM );
+#endif
+        if ( oconf->ht ) {
+            zptable_delete( oconf->ht );
+        }
+        oconf->ht = ht;
+        return;
+    }
+
+    /* Lazy values need a private table of this module to
+     * hold them - reading one changes its node, which the
+     * worker mustn't be doing at the same time; otherwise
+     * they are copied as usual. Decoded JSON strings
+     * aren't in the mapping */
+    if ( oconf->lazy && oconf->mode == OUTPUT_HASH && ! oconf->json ) {
+        HashTable ht = oconf->ht;
+        if ( ht && is_zptable( ht ) ) {
+            oconf->lazy_data = (const char *) data;
+        } else if ( oconf->debug ) {
+            fprintf( oconf->err, "zpopulator: Hash `%s' wasn't created by zpopulator, values are copied\n", oconf->target );
+            fflush( oconf->err );
+        }
+    }
+
+    /* Ranges are found by delimeters */
+    if ( oconf->jobs > 1 && ! oconf->framing && ( oconf->mode == OUTPUT_HASH || oconf->mode == OUTPUT_ARRAY ) ) {
+        parse_parallel( oconf, (const char *) data, len );
+    } else {
+        split_mapped( oconf, (const char *) data, len );
+    }
+
+    if ( oconf->lazy_data ) {
+        /* Table that holds the nodes now owns the mapping,
+         * which will be read in random order */
+        HashTable ht = oconf->ht;
+        oconf->lazy_data = NULL;
+        if ( ht && is_zptable( ht ) ) {
+#ifdef MADV_NORMAL
+            madvise( data, len, MADV_NORMAL );
+#endif
+            zptable_addmap( (struct zptable *) ht, data, len );
+            return;
+        }
+    }
+
+    munmap( data, len );
+}
+
+/* With -f, maps a regular file and parses it without
+ * copying; returns 0 if input has to be read instead */
+static int
+map_input( struct outconf *oconf ) {
+    struct stat st;
+    int fd = oconf->in_fd;
+
+    if ( ! oconf->file || fstat( fd, &st ) == -1 || ! S_ISREG( st.st_mode ) || st.st_size == 0 ) {
+        return 0;
+    }
+
+    /* Pages past the end of a file truncated meanwhile
+     * raise SIGBUS; -f documents that, `< file' is read */
+    size_t len = st.st_size;
+    void *data = mmap( NULL, len, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( data == MAP_FAILED ) {
+        if ( oconf->debug ) {
+            fprintf( oconf->err, "zpopulator: Couldn't map `%s', reading it: %s\n", oconf->file, strerror( errno ) );
+            fflush( oconf->err );
+        }
+        return 0;
+    }
+
+    STAT_ADD( oconf->worker->stats.bytes, len );
+    parse_mapping( oconf, data, len );
+    return 1;
+}
+
+/* Creates what the worker fills before the records come */
+static int
+prepare_output( struct outconf *oconf ) {
+    if ( oconf->mode == OUTPUT_HASH && oconf->private_hash ) {
+        oconf->ht = my_newparamtable( oconf->expected > 0 ? oconf->expected : 32, oconf->target );
+    }
+
+    if ( oconf->mode == OUTPUT_VARS ) {
+        oconf->varcache = new_varcache();
+    }
+
+    if ( ( oconf->mode == OUTPUT_VARS && ! oconf->varcache ) ||
+         ( oconf->mode == OUTPUT_HASH && oconf->private_hash && ! oconf->ht ) )
+    {
+        if ( ! oconf->silent ) {
             fputs( "zpopulator: Out of memory in thread", oconf->err );
             fflush( oconf->err );
         }
-        free_oconf_thread_safe( oconf );
-        workers_count --;
-        pthread_exit( &ret_success );
-        return &ret_success;
+        oconf->worker->error = "memory";
+        return 0;
+    }
+    return 1;
+}
+
+/* Hands over what was collected when input ends */
+static void
+publish_output( struct outconf *oconf ) {
+    if ( oconf->mode == OUTPUT_ARRAY ) {
+        publish_array( oconf, 1 );
+    } else if ( oconf->ht ) {
+        publish_hash( oconf );
+    }
+
+    delete_varcache( oconf->varcache );
+    oconf->varcache = NULL;
+}
+
+/* Descriptor given with -u. Its records go to `out' - the
+ * worker's own outconf, or a copy for a different target,
+ * shared by all descriptors with that target */
+struct source {
+    int fd;
+    /* Input has ended; `fd' is closed with the others */
+    int ended;
+    /* From "fd=name", NULL for worker's target */
+    char *target;
+    Param target_pm;
+    struct outconf *out;
+    struct inbuf in;
+};
+
+/* Worker thread can't zclose(), it hands descriptors
+ * back to main thread */
+static void
+free_sources( struct outconf *oconf, int in_worker ) {
+    int i;
+
+    if ( ! oconf->sources ) {
+        return;
+    }
+    for ( i = 0; i < oconf->nsources; i ++ ) {
+        struct source *src = &oconf->sources[ i ];
+        if ( src->fd != -1 ) {
+            if ( in_worker ) {
+                hand_back_fd( oconf->worker, src->fd );
+            } else {
+                zclose( src->fd );
+            }
+        }
+        if ( src->target ) {
+            my_zsfree( src->target );
+        }
+        inbuf_free( &src->in );
+    }
+    my_zfree( oconf->sources, oconf->nsources * sizeof( struct source ) );
+    oconf->sources = NULL;
+}
+
+/* Reads once from a ready source, storing complete records.
+ * Returns 0 when the source has ended */
+static int
+read_source( struct source *src ) {
+    struct outconf *out = src->out;
+
+    int ret = inbuf_reserve( out, &src->in, READ_SIZE );
+    if ( ret == 0 ) {
+        return 0;
+    }
+    if ( ret == -1 ) {
+        inbuf_drop( out, &src->in );
+    }
+
+    /* Level-triggered readiness, one read() can't block */
+    int eof = inbuf_read( out, &src->in, src->fd ) == 0;
+    inbuf_records( out, &src->in, eof );
+    return ! eof;
+}
+
+/* Descriptor stays open until free_sources(), so that
+ * its number can't be reused meanwhile */
+static void
+end_source( struct source *src ) {
+    src->ended = 1;
+    inbuf_free( &src->in );
+}
+
+/* Reads all -u descriptors in this one thread, as they
+ * become readable; each keeps its own partial record */
+static void
+fan_in( struct outconf *oconf ) {
+    int i, j, n = oconf->nsources, nsinks = 0, active = 0;
+    struct outconf *sinks = (struct outconf *) my_zshcalloc( n * sizeof( struct outconf ) );
+    struct source **ready = (struct source **) my_zshcalloc( n * sizeof( struct source * ) );
+
+    if ( ! sinks || ! ready ) {
+        oconf->worker->error = "memory";
+        goto done;
+    }
+
+    for ( i = 0; i < n; i ++ ) {
+        struct source *src = &oconf->sources[ i ];
+
+        src->out = oconf;
+        if ( src->target_pm && src->target_pm != oconf->target_pm ) {
+            for ( j = 0; j < nsinks; j ++ ) {
+                if ( sinks[ j ].target_pm == src->target_pm ) {
+                    src->out = &sinks[ j ];
+                    break;
+                }
+            }
+            if ( j == nsinks ) {
+                struct outconf *sink = &sinks[ nsinks ++ ];
+                *sink = *oconf;
+                sink->target = src->target;
+                sink->target_pm = src->target_pm;
+                sink->keybuf = NULL;
+                sink->keybuf_size = 0;
+                memset( sink->jbufs, 0, sizeof( sink->jbufs ) );
+                sink->ht = NULL;
+                sink->varcache = NULL;
+                sink->sources = NULL;
+                sink->nsources = 0;
+                memset( &sink->arr, 0, sizeof( struct arrbuild ) );
+                sink->arr.expected = oconf->arr.expected;
+                if ( ! prepare_output( sink ) ) {
+                    -- nsinks;
+                    goto done;
+                }
+                src->out = sink;
+            }
+        }
+
+        if ( ! inbuf_init( src->out, &src->in ) ) {
+            goto done;
+        }
+        active ++;
+    }
+
+#ifdef __linux__
+    struct epoll_event evs[ 64 ];
+    int ep = epoll_create1( EPOLL_CLOEXEC );
+    if ( ep == -1 ) {
+        fprintf( oconf->err, "zpopulator: Couldn't create epoll instance: %s\n", strerror( errno ) );
+        fflush( oconf->err );
+        oconf->worker->error = "read";
+        goto done;
+    }
+
+    for ( i = 0; i < n; i ++ ) {
+        struct source *src = &oconf->sources[ i ];
+        struct epoll_event ev;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = src;
+        if ( epoll_ctl( ep, EPOLL_CTL_ADD, src->fd, &ev ) == -1 ) {
+            /* Regular file is always readable and can't be
+             * watched - it's read through right now */
+            while ( read_source( src ) ) {
+            }
+            end_source( src );
+            active --;
+        }
+    }
+#else
+    struct pollfd *pfds = (struct pollfd *) my_zshcalloc( n * sizeof( struct pollfd ) );
+    if ( ! pfds ) {
+        oconf->worker->error = "memory";
+        goto done;
+    }
+#endif
+
+    while ( active > 0 ) {
+        int nready = 0;
+
+        if ( oconf->worker->queue && queue_cancelled( oconf->worker->queue ) ) {
+            break;
+        }
+
+#ifdef __linux__
+        int count = epoll_wait( ep, evs, n < 64 ? n : 64, -1 );
+        for ( i = 0; i < count; i ++ ) {
+            ready[ nready ++ ] = (struct source *) evs[ i ].data.ptr;
+        }
+#else
+        int count, npfds = 0;
+        for ( i = 0; i < n; i ++ ) {
+            if ( ! oconf->sources[ i ].ended ) {
+                pfds[ npfds ].fd = oconf->sources[ i ].fd;
+                pfds[ npfds ].events = POLLIN;
+                pfds[ npfds ].revents = 0;
+                ready[ npfds ++ ] = &oconf->sources[ i ];
+            }
+        }
+        count = poll( pfds, npfds, -1 );
+        for ( i = 0; i < npfds && count > 0; i ++ ) {
+            if ( pfds[ i ].revents ) {
+                ready[ nready ++ ] = ready[ i ];
+            }
+        }
+#endif
+        if ( count == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            fprintf( oconf->err, "zpopulator: Waiting for input failed: %s\n", strerror( errno ) );
+            fflush( oconf->err );
+            oconf->worker->error = "read";
+            break;
+        }
+
+        /* Hang-up or error is reported as readable, too;
+         * read() then returns 0 or fails, ending the source */
+        for ( i = 0; i < nready; i ++ ) {
+            if ( ! read_source( ready[ i ] ) ) {
+#ifdef __linux__
+                /* Shell can hold another descriptor of the same
+                 * pipe, closing ours wouldn't unregister it */
+                epoll_ctl( ep, EPOLL_CTL_DEL, ready[ i ]->fd, NULL );
+#endif
+                end_source( ready[ i ] );
+                active --;
+            }
+        }
+    }
+
+#ifdef __linux__
+    close( ep );
+#else
+    my_zfree( pfds, n * sizeof( struct pollfd ) );
+#endif
+
+done:
+    for ( j = 0; j < nsinks; j ++ ) {
+        publish_output( &sinks[ j ] );
+        if ( sinks[ j ].keybuf ) {
+            my_zsfree( sinks[ j ].keybuf );
+        }
+        free_jbufs( &sinks[ j ] );
+    }
+    if ( sinks ) {
+        my_zfree( sinks, n * sizeof( struct outconf ) );
+    }
+    if ( ready ) {
+        my_zfree( ready, n * sizeof( struct source * ) );
+    }
+    free_sources( oconf, 1 );
+}
+
+/* this function is run by the second thread */
+static
+void *process_input( void *void_ptr ) {
+    static int ret_success = 0, ret_failure = 1;
+
+    /* Instructs what to do */
+    struct outconf *oconf = ( struct outconf *) void_ptr;
+
+    int tries = 0;
+
+    thread_stats = &oconf->worker->stats;
+
+    /* With -f, -c or -u, main thread has already opened input */
+    if ( oconf->in_fd != -1 || oconf->sources ) {
+        goto have_input;
+    }
+
+duplicate_stdin:
+    /* Duplicate standard input */
+    oconf->stream = fdopen( dup( fileno( stdin ) ), "r" );
+
+    ++ tries;
+
+    if ( NULL == oconf->stream || fileno( oconf->stream ) == -1 ) {
+        int file = oconf->stream ? fileno( oconf->stream ) : 0;
+        fprintf( stderr, "Failed to duplicate stream [%d]: %p (%d), %s\n", tries, oconf->stream, file, strerror( errno ) );
+        fflush( stderr );
+        if ( tries < 8 ) {
+            goto duplicate_stdin;
+        } else {
+            signal_started( oconf );
+            oconf->stream = NULL;
+            oconf->worker->error = "stdin";
+            return finish_worker( oconf, &ret_failure );
+        }
+    }
+
+    /* Submit the FD to Zsh */
+    oconf->in_fd = fileno( oconf->stream );
+    addmodulefd( oconf->in_fd, FDT_MODULE );
+
+have_input:
+    signal_started( oconf );
+
+    if ( ! prepare_output( oconf ) ) {
+        return finish_worker( oconf, &ret_failure );
+    }
+
+    if ( oconf->sources ) {
+        fan_in( oconf );
+    } else if ( ! map_input( oconf ) ) {
+        read_input( oconf );
+    }
+
+    publish_output( oconf );
+
+    /* Whatever was read is stored, but report the failure */
+    if ( oconf->worker->error ) {
+        return finish_worker( oconf, &ret_failure );
+    }
+
+    return finish_worker( oconf, &ret_success );
+}
+
+/* Starts `command' - words separated by $IFS characters,
+ * empty ones dropped, backslash quotes a separator - with
+ * standard output to a pipe, standard input from /dev/null.
+ * The shell isn't forked, posix_spawn uses vfork() or clone()
+ * where it can. Returns read end of the pipe, or -1 with
+ * errno set. The producer is reaped by the shell's SIGCHLD
+ * handler, as any other child */
+static int
+spawn_producer( char *command, pid_t *pidp ) {
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    int fds[ 2 ], err, i, n;
+
+    /* Null words come from separators other than white space
+     * that are adjacent, or lead; they aren't arguments */
+    char **words = spacesplit( command, 1, 1, 1 );
+    for ( i = n = 0; words[ i ]; i ++ ) {
+        if ( *words[ i ] ) {
+            words[ n ++ ] = words[ i ];
+        }
+    }
+    words[ n ] = NULL;
+    if ( ! words[ 0 ] ) {
+        errno = EINVAL;
+        return -1;
+    }
+    for ( i = 0; words[ i ]; i ++ ) {
+        unmetafy( words[ i ], NULL );
+    }
+
+    if ( pipe( fds ) == -1 ) {
+        return -1;
+    }
+    fcntl( fds[ 0 ], F_SETFD, FD_CLOEXEC );
+    fcntl( fds[ 1 ], F_SETFD, FD_CLOEXEC );
+
+    /* dup2() clears close-on-exec of the copy */
+    posix_spawn_file_actions_init( &fa );
+    posix_spawn_file_actions_addopen( &fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0 );
+    posix_spawn_file_actions_adddup2( &fa, fds[ 1 ], STDOUT_FILENO );
+
+    /* Shell ignores or blocks some signals, producer
+     * shouldn't inherit that. It isn't a job the shell
+     * could continue, so it gets its own process group,
+     * out of reach of ^C and ^Z at the prompt; SIGTTOU
+     * stays ignored, it can write to terminal's stderr */
+    posix_spawnattr_init( &attr );
+    sigemptyset( &sigs );
+    posix_spawnattr_setsigmask( &attr, &sigs );
+    sigaddset( &sigs, SIGINT );
+    sigaddset( &sigs, SIGQUIT );
+    sigaddset( &sigs, SIGPIPE );
+    sigaddset( &sigs, SIGTSTP );
+    sigaddset( &sigs, SIGTTIN );
+    posix_spawnattr_setsigdefault( &attr, &sigs );
+    posix_spawnattr_setpgroup( &attr, 0 );
+    posix_spawnattr_setflags( &attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP );
+
+    err = posix_spawnp( pidp, words[ 0 ], &fa, &attr, words, environ );
+
+    posix_spawn_file_actions_destroy( &fa );
+    posix_spawnattr_destroy( &attr );
+    close( fds[ 1 ] );
+
+    if ( err ) {
+        close( fds[ 0 ] );
+        errno = err;
+        return -1;
+    }
+    return fds[ 0 ];
+}
+
+/* Splits unmetafied `len' bytes of path "a.b.c" (leading
+ * dot optional) into member names; "." is the whole object */
+static int
+set_jpath( struct jpath *jp, const char *spec, int len ) {
+    int i, n = 1;
+    char *p;
+
+    if ( len > 0 && *spec == '.' ) {
+        spec ++;
+        len --;
+    }
+    jp->str = (char *) my_zalloc( len + 1 );
+    if ( ! jp->str ) {
+        return 0;
+    }
+    memcpy( jp->str, spec, len );
+    jp->str[ len ] = '\0';
+    if ( len == 0 ) {
+        jp->depth = 0;
+        return 1;
+    }
+
+    for ( i = 0; i < len; i ++ ) {
+        n += jp->str[ i ] == '.';
+    }
+    jp->names = (char **) my_zshcalloc( n * sizeof( char * ) );
+    jp->lens = (int *) my_zshcalloc( n * sizeof( int ) );
+    jp->depth = n;
+    if ( ! jp->names || ! jp->lens ) {
+        return 0;
+    }
+
+    for ( i = 0, p = jp->str; i < n; i ++ ) {
+        char *dot = memchr( p, '.', jp->str + len - p );
+        jp->names[ i ] = p;
+        jp->lens[ i ] = ( dot ? dot : jp->str + len ) - p;
+        if ( jp->lens[ i ] == 0 ) {
+            return 0;
+        }
+        p += jp->lens[ i ] + 1;
+    }
+    return 1;
+}
+
+/* Parses -J: "." stores members of flat objects, in hash
+ * or variable mode; "keypath=valuepath" stores one value
+ * per line under key found at `keypath'; with -a or -q,
+ * "path" selects the value of each line */
+static int
+set_json( struct outconf *oconf, const char *arg ) {
+    int len;
+    char *spec = unmetafy( dupstring( arg ), &len );
+    char *eq = memchr( spec, '=', len );
+
+    if ( oconf->mode == OUTPUT_HASH || oconf->mode == OUTPUT_VARS ) {
+        if ( ! eq ) {
+            if ( len != 1 || *spec != '.' ) {
+                return 0;
+            }
+            oconf->json = JSON_FLAT;
+            return 1;
+        }
+        oconf->json = JSON_PATH;
+        return set_jpath( &oconf->jkey, spec, eq - spec ) &&
+               set_jpath( &oconf->jval, eq + 1, len - ( eq - spec ) - 1 );
+    }
+
+    if ( eq ) {
+        return 0;
+    }
+    oconf->json = JSON_PATH;
+    return set_jpath( &oconf->jval, spec, len );
+}
+
+/* Parses -F: "nul", "net", "len", "fixed:W" or "fixed:K:V" */
+static int
+set_framing( struct outconf *oconf, const char *spec ) {
+    char *end;
+
+    if ( ! strcmp( spec, "nul" ) ) {
+        oconf->framing = FRAME_NUL;
+    } else if ( ! strcmp( spec, "net" ) ) {
+        oconf->framing = FRAME_NET;
+    } else if ( ! strcmp( spec, "len" ) ) {
+        oconf->framing = FRAME_LEN;
+    } else if ( ! strncmp( spec, "fixed:", 6 ) ) {
+        long width = strtol( spec + 6, &end, 10 ), vwidth = 0;
+        if ( *end == ':' ) {
+            const char *v = end + 1;
+            vwidth = strtol( v, &end, 10 );
+            if ( end == v || vwidth < 0 ) {
+                return 0;
+            }
+            oconf->fixed_key = width;
+            width += vwidth;
+        }
+        if ( end == spec + 6 || *end != '\0' || width <= 0 || width > INT_MAX ||
+             oconf->fixed_key < 0 || ( vwidth && oconf->fixed_key == 0 ) )
+        {
+            return 0;
+        }
+        oconf->framing = FRAME_FIXED;
+        oconf->fixed_len = width;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* Number of bytes, with optional k, m or g suffix; -1 if
+ * the string isn't such number */
+static long
+parse_size( const char *str ) {
+    char *end;
+    long size = strtol( str, &end, 10 );
+
+    switch ( *end ) {
+        case 'k': case 'K': size *= 1024; end ++; break;
+        case 'm': case 'M': size *= 1024 * 1024; end ++; break;
+        case 'g': case 'G': size *= 1024 * 1024 * 1024L; end ++; break;
+    }
+    if ( end == str || *end != '\0' ) {
+        return -1;
+    }
+    return size;
+}
+
+/* Decimal number from `min' to `max'; -1 if the string
+ * isn't such number */
+static long
+parse_count( const char *str, long min, long max ) {
+    char *end;
+
+    errno = 0;
+    long count = strtol( str, &end, 10 );
+    if ( end == str || *end != '\0' || errno || count < min || count > max ) {
+        return -1;
+    }
+    return count;
+}
+
+/* Takes descriptors of -u, "fd" or "fd=name" separated
+ * by spaces. Each is duplicated, so that the caller can
+ * close its own; a name is resolved as the target is */
+static int
+add_sources( struct outconf *oconf, char *spec ) {
+    char **words = spacesplit( spec, 0, 1, 0 );
+    int i, n = arrlen( words );
+
+    if ( n == 0 ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: -u requires at least one descriptor, aborting\n" );
+            fflush( stderr );
+        }
+        return 0;
+    }
+
+    oconf->sources = (struct source *) my_zshcalloc( n * sizeof( struct source ) );
+    if ( ! oconf->sources ) {
+        return 0;
+    }
+    oconf->nsources = n;
+    for ( i = 0; i < n; i ++ ) {
+        oconf->sources[ i ].fd = -1;
+    }
+
+    for ( i = 0; i < n; i ++ ) {
+        struct source *src = &oconf->sources[ i ];
+        char *name = strchr( words[ i ], '=' ), *end;
+
+        if ( name ) {
+            *name ++ = '\0';
+        }
+        long fd = strtol( words[ i ], &end, 10 );
+        if ( *words[ i ] == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX || fcntl( fd, F_GETFD ) == -1 ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "zpopulator: Bad descriptor `%s', aborting\n", words[ i ] );
+                fflush( stderr );
+            }
+            return 0;
+        }
+
+        if ( name ) {
+            if ( oconf->mode != OUTPUT_HASH && oconf->mode != OUTPUT_ARRAY ) {
+                if ( ! oconf->silent ) {
+                    fprintf( stderr, "zpopulator: `%s=%s' requires -a or -A, aborting\n", words[ i ], name );
+                    fflush( stderr );
+                }
+                return 0;
+            }
+            src->target = my_ztrdup( name );
+            if ( oconf->mode == OUTPUT_HASH ) {
+                src->target_pm = ensurethereishash( name, oconf );
+            } else {
+                src->target_pm = ensurethereisarray( name, oconf );
+            }
+            if ( ! src->target_pm ) {
+                return 0;
+            }
+        }
+
+        src->fd = movefd( dup( fd ) );
+        if ( src->fd == -1 ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "zpopulator: Couldn't duplicate descriptor %ld: %s\n", fd, strerror( errno ) );
+                fflush( stderr );
+            }
+            return 0;
+        }
+        fcntl( src->fd, F_SETFD, FD_CLOEXEC );
+        addmodulefd( src->fd, FDT_MODULE );
+    }
+
+    return 1;
+}
+
+/* Worker only stores value pointers of its targets, their
+ * flags are changed by main thread, while the shell isn't
+ * looking. Clears PM_UNSET and notes in `was_unset' which
+ * targets had it (the worker's, then one per -u source);
+ * with `restore', sets it back on those */
+static void
+mark_targets_set( struct outconf *oconf, char *was_unset, int restore ) {
+    int i;
+
+    for ( i = 0; i <= oconf->nsources; i ++ ) {
+        Param pm = i ? oconf->sources[ i - 1 ].target_pm : oconf->target_pm;
+        if ( ! pm ) {
+            continue;
+        }
+        if ( restore ) {
+            if ( was_unset[ i ] ) {
+                pm->node.flags |= PM_UNSET;
+            }
+        } else {
+            was_unset[ i ] = ( pm->node.flags & PM_UNSET ) != 0;
+            pm->node.flags &= ~PM_UNSET;
+        }
+    }
+}
+
+/*
+ * Options:
+ * -a name - put input into global array `name'
+ * -b count - with -a, publish array every `count' records
+ * -p - with -A, fill private hash and swap it in at end
+ * -n count - expected number of records
+ * -i name - parameter to receive worker ID
+ * -A name - put input into global hash `name', keys and values
+ *           alternating
+ * -x - put input into global variables, names and values determined
+ *      as with hash (-d/-D); variables must already exist
+ * -q size - queue records for zpread, at most `size' at a time
+ * -f file - read `file' instead of standard input, mapping it;
+ *           truncating the file while mapped raises SIGBUS
+ * -c command - spawn `command', in its own process group, and
+ *              read its standard output
+ * -u fds - read descriptors `fds' ("fd" or "fd=name", space
+ *          separated) in one thread, each into its own target
+ * -M size - bound input buffer; with -A -p, also the hash, by
+ *           spilling input to a mapped temporary file
+ * -F format - framing instead of main delimeter: nul, net, len,
+ *             fixed:W or fixed:K:V
+ * -J spec - records are JSON objects: "." stores members, or
+ *           "keypath=valuepath"; with -a/-q, "path"
+ * -j count - with -f and -a/-A, parse using `count' threads
+ * -l - with -f, -A and -p, leave values in mapped file until read
+ * -L - as -l, but don't keep values that were read
+ * -I - with -f and -A, make `name' a read-only index over the file
+ * -d string - main delimeter dividing into array elements
+ * -D string - sub-delimeter, to divide into key and value
+ * -T - time stages of the worker loop, for zpstats
+ */
+
+static int
+bin_zpopulator( char *name, char **argv, Options ops, int func )
+{
+    reap_retired();
+
+    if ( OPT_ISSET( ops, 'h' ) ) {
+        show_help();
+        return 0;
+    }
+
+    if ( OPT_ISSET( ops, 'a' ) + OPT_ISSET( ops, 'A' ) + OPT_ISSET( ops, 'x' ) + OPT_ISSET( ops, 'q' ) != 1 ) {
+        if ( ! OPT_ISSET( ops, 's' ) ) {
+            fprintf( stderr, "Error: Exactly one of following options is required: -a, -A, -x, -q\n" );
+            fprintf( stderr, "See help.\n" );
+        } else {
+            fprintf( stderr, "Require -a, -A, -x or -q\n" );
+        }
+        fflush( stderr );
+        return 1;
+    }
+
+    struct outconf *oconf = zalloc( sizeof( struct outconf ) );
+    oconf->mode = OUTPUT_VARS;
+    oconf->target = NULL;
+    oconf->target_pm = NULL;
+    set_delimiter( &oconf->main_d, ztrdup("\n"), 1 );
+    set_delimiter( &oconf->sub_d, ztrdup(":"), 1 );
+    oconf->framing = FRAME_DELIM;
+    oconf->fixed_len = 0;
+    oconf->fixed_key = 0;
+    oconf->json = 0;
+    memset( &oconf->jkey, 0, sizeof( struct jpath ) );
+    memset( &oconf->jval, 0, sizeof( struct jpath ) );
+    memset( oconf->jbufs, 0, sizeof( oconf->jbufs ) );
+    oconf->json_bad = 0;
+    oconf->keybuf = NULL;
+    oconf->keybuf_size = 0;
+    oconf->file = NULL;
+    oconf->sources = NULL;
+    oconf->nsources = 0;
+    oconf->limit = 0;
+    oconf->spill_fd = -1;
+    oconf->arr.elems = NULL;
+    oconf->arr.count = 0;
+    oconf->arr.cap = 0;
+    oconf->expected = OPT_ISSET( ops, 'n' ) ? atoi( OPT_ARG( ops, 'n' ) ) : 0;
+    if ( oconf->expected < 0 ) {
+        oconf->expected = 0;
+    } else if ( oconf->expected > EXPECTED_MAX ) {
+        oconf->expected = EXPECTED_MAX;
+    }
+    oconf->arr.expected = oconf->expected;
+    oconf->varcache = NULL;
+    oconf->var_epoch = 0;
+    oconf->private_hash = OPT_ISSET( ops, 'p' );
+    oconf->ht = NULL;
+    oconf->jobs = 1;
+    oconf->lazy = OPT_ISSET( ops, 'l' ) || OPT_ISSET( ops, 'L' );
+    /* Index is built privately, like with -p; without
+     * mappable input, a private hash is built instead */
+    oconf->index = OPT_ISSET( ops, 'I' );
+    if ( oconf->index ) {
+        oconf->private_hash = 1;
+    }
+    oconf->lazy_cache = ! OPT_ISSET( ops, 'L' );
+    oconf->lazy_data = NULL;
+    oconf->batch = 0;
+    oconf->stream = NULL;
+    oconf->in_fd = -1;
+    oconf->err = NULL;
+    oconf->r_devnull = NULL;
+
+    int tries = 0;
+
+duplicate_stderr:
+    oconf->err = fdopen( dup( fileno( stderr ) ), "w" );
+
+    ++ tries;
+
+    if ( NULL == oconf->err || fileno( oconf->err ) == -1 ) {
+        int file = oconf->err ? fileno( oconf->err ) : 0;
+        fprintf( stderr, "Failed to duplicate stderr [%d]: %p (%d), %s\n", tries, oconf->err, file, strerror( errno ) );
+        fflush( stderr );
+
+        if ( tries < 8 ) {
+            goto duplicate_stderr;
+        } else {
+            oconf->err = NULL;
+            free_oconf( oconf );
+            return 1;
+        }
+    }
+
+    /* Submit the duplicated stderr FD to Zsh */
+    addmodulefd( fileno( oconf->err ), FDT_MODULE );
+
+    tries = 0;
+
+    /* Prepare standard input replacement */
+    oconf->r_devnull = fopen( "/dev/null", "r");
+    /* Replace standard input with /dev/null */
+    // dup2( fileno( oconf->r_devnull ), STDIN_FILENO );
+    fclose( oconf->r_devnull );
+    oconf->r_devnull = NULL;
+
+    oconf->silent = OPT_ISSET( ops, 's' );
+    oconf->only_global = OPT_ISSET( ops, 'g' );
+    oconf->debug = OPT_ISSET( ops, 'v' );
+
+    /* Counts */
+    long capacity = 1024;
+    if ( OPT_ISSET( ops, 'j' ) && ( oconf->jobs = parse_count( OPT_ARG( ops, 'j' ), 1, JOBS_MAX ) ) < 0 ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: Bad -j count `%s', expected 1 to %d, aborting\n", OPT_ARG( ops, 'j' ), JOBS_MAX );
+            fflush( stderr );
+        }
+        free_oconf( oconf );
+        return 1;
+    }
+    if ( OPT_ISSET( ops, 'b' ) && ( oconf->batch = parse_count( OPT_ARG( ops, 'b' ), 1, INT_MAX ) ) < 0 ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: Bad -b count `%s', expected a positive number, aborting\n", OPT_ARG( ops, 'b' ) );
+            fflush( stderr );
+        }
+        free_oconf( oconf );
+        return 1;
+    }
+    if ( OPT_ISSET( ops, 'q' ) && ( capacity = parse_count( OPT_ARG( ops, 'q' ), 1, QUEUE_MAX ) ) < 0 ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: Bad -q size `%s', expected 1 to %d, aborting\n", OPT_ARG( ops, 'q' ), QUEUE_MAX );
+            fflush( stderr );
+        }
+        free_oconf( oconf );
+        return 1;
+    }
+
+    /* Array targets */
+    if ( OPT_ISSET( ops, 'a' ) ) {
+       oconf->mode = OUTPUT_ARRAY;
+       oconf->target = ztrdup( OPT_ARG( ops, 'a' ) );
+    } else if ( OPT_ISSET( ops, 'A' ) ) {
+       oconf->mode = OUTPUT_HASH;
+       oconf->target = ztrdup( OPT_ARG( ops, 'A' ) );
+    } else if ( OPT_ISSET( ops, 'q' ) ) {
+       oconf->mode = OUTPUT_QUEUE;
+    }
+
+    /* Delimeters */
+
+    /* Delimeters are searched for in raw input, so unmetafy */
+
+    if ( OPT_ISSET( ops, 'd' ) ) {
+        int len;
+        char *d = unmetafy( ztrdup( OPT_ARG( ops, 'd' ) ), &len );
+        zsfree( oconf->main_d.str );
+        set_delimiter( &oconf->main_d, d, len );
+    }
+
+    if ( OPT_ISSET( ops, 'D' ) ) {
+        int len;
+        char *d = unmetafy( ztrdup( OPT_ARG( ops, 'D' ) ), &len );
+        zsfree( oconf->sub_d.str );
+        set_delimiter( &oconf->sub_d, d, len );
+    }
+
+    if ( oconf->main_d.len == 0 || oconf->sub_d.len == 0 ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: Delimeters cannot be empty, aborting\n" );
+            fflush( stderr );
+        }
+        free_oconf( oconf );
+        return 1;
     }
 
-    /* Make those handy */
-    int main_d_len = oconf->main_d_len;
-    int sub_d_len = oconf->sub_d_len;
-    int read_size = 5;
-    volatile int loop_counter = 0;
+    /* Shell reading a lazy value changes the node, so the
+     * table mustn't be visible while the worker fills it */
+    if ( oconf->lazy && ! oconf->private_hash ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: -l and -L require -p, aborting\n" );
+            fflush( stderr );
+        }
+        free_oconf( oconf );
+        return 1;
+    }
 
-    while ( 1 ) {
-        /* Loop counter used for debugging */
-        ++ loop_counter;
-
-        /* Check if data will fit into buffer - sum current
-         * number of bytes in buffer (`index`) and possible
-         * maximum read size (`read_size`) and trailing null
-         * byte that will be added. Also, possible addition
-         * of main delimeter. */
-        if ( index + read_size + 1 + main_d_len > bufsize ) {
-            bufsize *= 1.5;
-            char * save_buf = buf;
-            buf = realloc( buf, bufsize );
-            if ( ! buf ) {
-                fprintf( oconf->err, "zpopulator: Fatal error - could not reallocate buffer, lines are too long" );
-                fflush( oconf->err );
-                free( save_buf );
-                break;
+    if ( oconf->batch && oconf->mode != OUTPUT_ARRAY ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: -b requires -a, aborting\n" );
+            fflush( stderr );
+        }
+        free_oconf( oconf );
+        return 1;
+    }
+
+    if ( OPT_ISSET( ops, 'F' ) && ! set_framing( oconf, OPT_ARG( ops, 'F' ) ) ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: Unknown framing `%s', aborting\n", OPT_ARG( ops, 'F' ) );
+            fflush( stderr );
+        }
+        free_oconf( oconf );
+        return 1;
+    }
+
+    /* Keyed frames don't go through handle_json() */
+    if ( OPT_ISSET( ops, 'F' ) && OPT_ISSET( ops, 'J' ) ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: -F and -J are mutually exclusive, aborting\n" );
+            fflush( stderr );
+        }
+        free_oconf( oconf );
+        return 1;
+    }
+
+    if ( OPT_ISSET( ops, 'J' ) && ! set_json( oconf, OPT_ARG( ops, 'J' ) ) ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: Bad -J spec `%s', expected %s, aborting\n", OPT_ARG( ops, 'J' ),
+                     oconf->mode == OUTPUT_HASH || oconf->mode == OUTPUT_VARS ? "`.' or `keypath=valuepath'" : "`path'" );
+            fflush( stderr );
+        }
+        free_oconf( oconf );
+        return 1;
+    }
+
+    /* Worker ID - given, or first free one */
+    int wanted_id = 0;
+    if ( *argv ) {
+        wanted_id = atoi( *argv );
+        if ( wanted_id < 1 ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "Worker thread ID should be a positive number, aborting\n" );
+                fflush( stderr );
             }
+            free_oconf( oconf );
+            return 1;
         }
+    }
 
-        errno = 0;
+    if ( oconf->mode == OUTPUT_HASH ) {
+        oconf->target_pm = ensurethereishash( oconf->target, oconf );
+    } else if ( oconf->mode == OUTPUT_ARRAY ) {
+        oconf->target_pm = ensurethereisarray( oconf->target, oconf );
+    }
 
-        int valid = 1;
+    if ( oconf->mode != OUTPUT_VARS && oconf->mode != OUTPUT_QUEUE && ! oconf->target_pm ) {
+        free_oconf( oconf );
+        return 1;
+    }
 
-        if ( -1 == fcntl( fileno( oconf->stream ), F_GETFD ) ) {
-            valid = 0;
+    /* Opened here, so that relative path and errors
+     * concern the current shell state */
+    if ( OPT_ISSET( ops, 'f' ) + OPT_ISSET( ops, 'c' ) + OPT_ISSET( ops, 'u' ) > 1 ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: -f, -c and -u are mutually exclusive, aborting\n" );
+            fflush( stderr );
         }
+        free_oconf( oconf );
+        return 1;
+    }
 
-        errno = 0;
+    if ( OPT_ISSET( ops, 'f' ) ) {
+        oconf->file = ztrdup( OPT_ARG( ops, 'f' ) );
+        int fd = movefd( open( unmeta( oconf->file ), O_RDONLY | O_NOCTTY ) );
+        if ( fd == -1 ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "zpopulator: Couldn't open `%s': %s\n", oconf->file, strerror( errno ) );
+                fflush( stderr );
+            }
+            free_oconf( oconf );
+            return 1;
+        }
+        fcntl( fd, F_SETFD, FD_CLOEXEC );
+        addmodulefd( fd, FDT_MODULE );
+        oconf->in_fd = fd;
+    }
 
-        /* Read e.g. 5 characters, putting them after previous portion */
-        // int count = fread( buf + index, 1, read_size, oconf->stream );
-        int count = read( fileno( oconf->stream ), buf + index, read_size );
-        if ( count == -1 )
-            count = 0;
-        /* Ensure that our whole data is a string - null terminated */
-        buf[ index + count ] = '\0';
+    if ( OPT_ISSET( ops, 'u' ) && ! add_sources( oconf, OPT_ARG( ops, 'u' ) ) ) {
+        free_oconf( oconf );
+        return 1;
+    }
 
-        if ( errno ) {
-            fprintf( oconf->err, "zpopulator: Read error (descriptor: %d, fcntl: %d, ferror: %d, [%s]): %s\n", fileno( oconf->stream ), valid, ferror( oconf->stream ), buf + index, strerror( errno ) );
+    /* Spill file is created here - gettempfile() isn't
+     * thread-safe. It's unlinked at once, a mapping of it
+     * outlives the descriptor */
+    if ( OPT_ISSET( ops, 'M' ) ) {
+        oconf->limit = parse_size( OPT_ARG( ops, 'M' ) );
+        if ( oconf->limit <= 0 ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "zpopulator: Bad -M size `%s', aborting\n", OPT_ARG( ops, 'M' ) );
+                fflush( stderr );
+            }
+            free_oconf( oconf );
+            return 1;
+        }
+        if ( oconf->limit < 2 * READ_SIZE ) {
+            oconf->limit = 2 * READ_SIZE;
         }
 
-        /* No data in buffer, and stream is ended -> break */
-        if ( feof( oconf->stream ) && (index+count) == 0 ) {
-            break;
+        /* Only values of a private table can stay in the
+         * spill file, and a regular file is mapped anyway */
+        struct stat st;
+        int regular = oconf->in_fd != -1 && fstat( oconf->in_fd, &st ) == 0 && S_ISREG( st.st_mode );
+        if ( oconf->mode == OUTPUT_HASH && oconf->private_hash && ! oconf->json && ! oconf->nsources && ! regular ) {
+            char *spill_name;
+            int fd = gettempfile( NULL, 1, &spill_name );
+            if ( fd == -1 ) {
+                if ( ! oconf->silent ) {
+                    fprintf( stderr, "zpopulator: Couldn't create spill file: %s\n", strerror( errno ) );
+                    fflush( stderr );
+                }
+                free_oconf( oconf );
+                return 1;
+            }
+            unlink( unmeta( spill_name ) );
+            oconf->spill_fd = movefd( fd );
+            fcntl( oconf->spill_fd, F_SETFD, FD_CLOEXEC );
+            addmodulefd( oconf->spill_fd, FDT_MODULE );
         }
+    }
 
-        /* Handle case with no final trailing main delimeter. This
-         * test can be ran multiple times, and only for the final
-         * portion of data the strstr() will return NULL. */
-        if ( feof( oconf->stream ) ) {
-            if ( oconf->debug ) {
-                fprintf( oconf->err, "End of stream with unprocessed data, index: %d, buf: %s\n", index, buf );
-                fflush( oconf->err );
+    /* Producer is started before the worker, so the
+     * worker doesn't need shell's standard input */
+    if ( OPT_ISSET( ops, 'c' ) ) {
+        pid_t pid;
+        int fd = movefd( spawn_producer( OPT_ARG( ops, 'c' ), &pid ) );
+        if ( fd == -1 ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "zpopulator: Couldn't start `%s': %s\n", OPT_ARG( ops, 'c' ), strerror( errno ) );
+                fflush( stderr );
             }
-            if( ! strstr( buf, oconf->main_d ) ) {
-                /* Enough room is ensured in top in this loop */
-                strcat( buf, oconf->main_d );
+            free_oconf( oconf );
+            return 1;
+        }
+        fcntl( fd, F_SETFD, FD_CLOEXEC );
+        addmodulefd( fd, FDT_MODULE );
+        oconf->in_fd = fd;
+    }
+
+    oconf->id = acquire_worker( wanted_id, oconf->silent );
+    if ( oconf->id < 0 ) {
+        free_oconf( oconf );
+        return 1;
+    }
+    oconf->worker = workers[ oconf->id ];
+
+    if ( ! open_worker_fd( oconf->worker ) ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: Couldn't create readiness pipe: %s\n", strerror( errno ) );
+            fflush( stderr );
+        }
+        free_oconf( oconf );
+        return 1;
+    }
+
+    if ( oconf->mode == OUTPUT_QUEUE ) {
+        oconf->worker->queue = new_queue( capacity );
+        if ( ! oconf->worker->queue ) {
+            if ( ! oconf->silent ) {
+                fprintf( stderr, "zpopulator: Couldn't create record queue: %s\n", strerror( errno ) );
+                fflush( stderr );
             }
+            close_worker_fd( oconf->worker );
+            free_oconf( oconf );
+            return 1;
+        }
+    }
+
+    /* The worker mustn't fail to hand a descriptor back */
+    oconf->worker->closefds = (int *) malloc( CLOSEFDS_MAX( oconf ) * sizeof( int ) );
+    oconf->worker->nclosefds = 0;
+    if ( ! oconf->worker->closefds ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: Couldn't allocate descriptor list: %s\n", strerror( errno ) );
+            fflush( stderr );
         }
+        if ( oconf->worker->queue ) {
+            free_queue( oconf->worker->queue );
+            oconf->worker->queue = NULL;
+        }
+        close_worker_fd( oconf->worker );
+        free_oconf( oconf );
+        return 1;
+    }
 
-        /* Look for main record divider */
-        if ( ( found = strstr( buf, oconf->main_d ) ) ) {
-            /**/
-            /* Will have to split one more time if OUTPUT_HASH */
-            /**/
+    /* Mark the thread as working */
+    oconf->worker->state = WORKER_RUNNING;
+    oconf->worker->status = 0;
+    oconf->worker->error = NULL;
+    oconf->worker->finished[ 0 ] = '0';
+    reset_stats( &oconf->worker->stats );
+    oconf->worker->stats.timed = OPT_ISSET( ops, 'T' );
 
-            if ( oconf->mode == OUTPUT_HASH ) {
-                /* Remember first character of main divider */
-                char mbkp = found[ 0 ];
-                /* Create string of the delimeted portion */
-                found[ 0 ] = '\0';
-
-                char *sfound = strstr( buf, oconf->sub_d );
-                if ( ! sfound ) {
-                    set_in_hash( oconf, buf, "" );
-                } else {
-                    char sbkp = sfound[ 0 ];
-                    /* Create string of the left side */
-                    sfound[ 0 ] = '\0';
-
-                    /* Store left side as key, right side as data */
-                    set_in_hash( oconf, buf, sfound + sub_d_len );
-
-                    /* Be maximal sane, restore overwritten data */
-                    sfound[ 0 ] = sbkp;
-                }
+    /* Sum up the created worker thread */
+    __atomic_fetch_add( &workers_count, 1, __ATOMIC_RELAXED );
 
-                /* Be maximal sane, restore overwritten data */
-                found[ 0 ] = mbkp;
-            } else
+#if 0
+    char buf[10];
+    if ( ! fread( buf, 1, 4, oconf->stream ) ) {
+        fprintf( stderr, "-- fread also failed, in main thread, fileno: %d\n", fileno( oconf->stream ) );
+        fflush( stderr );
+    }
+#endif
 
-            /**/
-            /* Just store for OUTPUT_ARRAY */
-            /**/
+    struct startup st;
+    pthread_cond_init( &st.cond, NULL );
+    pthread_mutex_init( &st.mutex, NULL );
+    st.started = 0;
+    oconf->startup = &st;
 
-            if ( oconf->mode == OUTPUT_ARRAY ) {
+    int id = oconf->id + 1;
+    struct worker *w = oconf->worker;
 
-            } else
+    pthread_mutex_lock( &st.mutex );
 
-            /**/
-            /* Create variable for every key (string before sub-delimeter) */
-            /**/
+    /* Last failure point is pthread_create(), a rejected
+     * call leaves the targets as they were */
+    char *was_unset = (char *) zhalloc( oconf->nsources + 1 );
+    mark_targets_set( oconf, was_unset, 0 );
 
-            if ( oconf->mode == OUTPUT_VARS ) {
-            }
+    /* Run the thread */
+    if ( pthread_create( &w->thread, NULL, process_input, oconf ) ) {
+        if ( ! oconf->silent ) {
+            fprintf( stderr, "zpopulator: Error creating thread\n" );
+            fflush( stderr );
+        }
+        mark_targets_set( oconf, was_unset, 1 );
 
-            /* Storing is done. Now move what's after processed
-             * data to beginning of `buf`, update `index`.
-             *
-             * Detect if all read data (index+count) is longer
-             * than what's before delimeter plus delimeter len */
-            if ( index + count > ( found - buf ) + main_d_len ) {
-                memmove( buf, found + main_d_len, index + count - ( ( found - buf ) + main_d_len ) );
-                /* Index of first byte to write to = amount of moved data */
-                index = index + count - ( ( found - buf ) + main_d_len );
-                /* Be maximal sane, store null byte */
-                buf[ index ] = '\0';
-            } else {
-                /* If we processed whole data package, so that we care
-                 * just about newly readed bytes, then we set index to
-                 * zero, as if we moved empty data to beginning and
-                 * trailed with null byte */
-                index = 0;
-            }
+        pthread_mutex_unlock( &st.mutex );
+        pthread_mutex_destroy( &st.mutex );
+        pthread_cond_destroy( &st.cond );
 
-        } else {
-            /* Prepare index for read of next portion of data */
-            index += count;
+        close_worker_fd( w );
+        if ( w->queue ) {
+            free_queue( w->queue );
+            w->queue = NULL;
         }
+        free( w->closefds );
+        w->closefds = NULL;
+        w->state = WORKER_FREE;
+        w->finished[ 0 ] = '1';
+        STAT_SET( w->stats.end_ns, now_ns() );
+        __atomic_fetch_sub( &workers_count, 1, __ATOMIC_RELAXED );
+        free_oconf( oconf );
+
+        return 1;
     }
 
-    /* Mark the thread as not working */
-    worker_finished[ oconf->id ][ 0 ] = '1';
+    while ( ! st.started ) {
+        pthread_cond_wait( &st.cond, &st.mutex );
+    }
+    pthread_mutex_unlock( &st.mutex );
+    pthread_mutex_destroy( &st.mutex );
+    pthread_cond_destroy( &st.cond );
 
-    /* Lower general workers counter */
-    workers_count --;
+    setiparam( OPT_ISSET( ops, 'i' ) ? OPT_ARG( ops, 'i' ) : "REPLY", id );
 
-    free_oconf_thread_safe( oconf );
+    return 0;
+}
+
+/* this function is run by separate thread */
 
-    pthread_exit( &ret_success );
-    return &ret_success;
+static void *eval_it( void *void_ptr ) {
+    struct zpinconf *pconf = ( struct zpinconf * ) void_ptr;
+    fprintf( stderr, "[2] Zpin has stdout: %d\n", fileno( stdout ) );
+    fflush( stderr );
+    bin_eval( NULL, pconf->command, NULL, 0 );
+    fprintf( stderr, "[3] Zpin has stdout: %d\n", fileno( stdout ) );
+    fflush( stderr );
+    return NULL;
+}
+
+/* Returns milliseconds left until `deadline', or -1 when
+ * there's no deadline - the poll() convention */
+static int
+ms_left( struct timespec *deadline ) {
+    struct timespec now;
+
+    if ( ! deadline ) {
+        return -1;
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    long ms = ( deadline->tv_sec - now.tv_sec ) * 1000 + ( deadline->tv_nsec - now.tv_nsec ) / 1000000;
+    return ms > 0 ? ms : 0;
+}
+
+/* Sets `deadline' to `timeout' seconds from now; returns
+ * 0 if `timeout_str' isn't a non-negative number */
+static int
+set_deadline( struct timespec *deadline, const char *timeout_str ) {
+    char *end;
+    double timeout = strtod( timeout_str, &end );
+    if ( end == timeout_str || *end || ! ( timeout >= 0 ) || timeout > 1e9 ) {
+        return 0;
+    }
+    clock_gettime( CLOCK_MONOTONIC, deadline );
+    deadline->tv_sec += (time_t) timeout;
+    deadline->tv_nsec += ( timeout - (time_t) timeout ) * 1e9;
+    if ( deadline->tv_nsec >= 1000000000 ) {
+        deadline->tv_sec ++;
+        deadline->tv_nsec -= 1000000000;
+    }
+    return 1;
 }
 
 /*
  * Options:
- * -a name - put input into global array `name'
- * -A name - put input into global hash `name', keys and values
- *           alternating
- * -x - put input into global variables, names and values determined
- *      as with hash (-d/-D); variables must already exist
- * -d string - main delimeter dividing into array elements
- * -D string - sub-delimeter, to divide into key and value
+ * -t timeout - seconds to wait at most
+ * -a - wait for all workers
+ * -o - wait for any worker
  */
-
 static int
-bin_zpopulator( char *name, char **argv, Options ops, int func )
+bin_zpwait( char *name, char **argv, Options ops, int func )
 {
-    fprintf( stderr, "zpopulator stdin: %d\n", fileno( stdin ) );
-    fflush( stderr );
+    int i, count, done, any, timed_out = 0, failed = 0;
+    struct timespec deadline, *dl = NULL;
+
+    reap_retired();
 
     if ( OPT_ISSET( ops, 'h' ) ) {
-        show_help();
+        show_help_zpwait();
         return 0;
     }
 
-    if ( OPT_ISSET( ops, 'a' ) + OPT_ISSET( ops, 'A' ) + OPT_ISSET( ops, 'x' ) != 1 ) {
-        if ( ! OPT_ISSET( ops, 's' ) ) {
-            fprintf( stderr, "Error: Exactly one of following options is required: -a, -A, -x\n" );
-            fprintf( stderr, "See help.\n" );
-        } else {
-            fprintf( stderr, "Require -a, -A or -x\n" );
-        }
-        fflush( stderr );
+    if ( OPT_ISSET( ops, 'a' ) && OPT_ISSET( ops, 'o' ) ) {
+        zwarnnam( name, "-a and -o are mutually exclusive" );
         return 1;
     }
+    any = OPT_ISSET( ops, 'o' );
 
-    struct outconf *oconf = zalloc( sizeof( struct outconf ) );
-    oconf->mode = OUTPUT_VARS;
-    oconf->target = NULL;
-    oconf->target_pm = NULL;
-    oconf->main_d = ztrdup("\n");
-    oconf->main_d_len = 1;
-    oconf->sub_d = ztrdup(":");
-    oconf->sub_d_len = 1;
-    oconf->stream = NULL;
-    oconf->err = NULL;
-    oconf->r_devnull = NULL;
+    if ( OPT_ISSET( ops, 't' ) ) {
+        if ( ! set_deadline( &deadline, OPT_ARG( ops, 't' ) ) ) {
+            zwarnnam( name, "bad timeout: %s", OPT_ARG( ops, 't' ) );
+            return 1;
+        }
+        dl = &deadline;
+    }
 
-    int tries = 0;
+    count = arrlen( argv );
+    if ( count == 0 ) {
+        zwarnnam( name, "worker ID expected" );
+        return 1;
+    }
 
-duplicate_stderr:
-    oconf->err = fdopen( dup( fileno( stderr ) ), "w" );
+    struct worker **ws = (struct worker **) zhalloc( count * sizeof( struct worker * ) );
+    int *ids = (int *) zhalloc( count * sizeof( int ) );
+    struct pollfd *pfds = (struct pollfd *) zhalloc( count * sizeof( struct pollfd ) );
 
-    ++ tries;
+    for ( i = 0; i < count; i ++ ) {
+        ids[ i ] = atoi( argv[ i ] );
+        if ( ids[ i ] < 1 || ids[ i ] > workers_size ) {
+            zwarnnam( name, "no such worker: %s", argv[ i ] );
+            return 1;
+        }
+        ws[ i ] = workers[ ids[ i ] - 1 ];
+        /* Free slot that never ran has no outcome */
+        if ( ! STAT_GET( ws[ i ]->stats.start_ns ) ) {
+            zwarnnam( name, "worker never started: %s", argv[ i ] );
+            return 1;
+        }
+    }
 
-    if ( NULL == oconf->err || fileno( oconf->err ) == -1 ) {
-        int file = oconf->err ? fileno( oconf->err ) : 0;
-        fprintf( stderr, "Failed to duplicate stderr [%d]: %p (%d), %s\n", tries, oconf->err, file, strerror( errno ) );
-        fflush( stderr );
+    while ( 1 ) {
+        int npfds = 0;
+
+        /* Finished slot is either FINISHED or already
+         * joined, i.e. FREE, keeping the last outcome */
+        done = 0;
+        for ( i = 0; i < count; i ++ ) {
+            if ( __atomic_load_n( &ws[ i ]->state, __ATOMIC_ACQUIRE ) != WORKER_RUNNING ) {
+                done ++;
+            } else {
+                pfds[ npfds ].fd = ws[ i ]->fd;
+                pfds[ npfds ].events = POLLIN;
+                pfds[ npfds ].revents = 0;
+                npfds ++;
+            }
+        }
 
-        if ( tries < 8 ) {
-            goto duplicate_stderr;
-        } else {
-            oconf->err = NULL;
-            free_oconf( oconf );
+        if ( any ? done > 0 : done == count ) {
+            break;
+        }
+
+        /* Worker marks its slot finished before writing
+         * to the fd, so the re-check above can't miss it */
+        int ret = poll( pfds, npfds, ms_left( dl ) );
+        if ( ret == 0 ) {
+            timed_out = 1;
+            break;
+        }
+        if ( ret == -1 ) {
+            if ( errno == EINTR && ! errflag ) {
+                continue;
+            }
+            if ( errno != EINTR ) {
+                zwarnnam( name, "poll failed: %e", errno );
+            }
             return 1;
         }
     }
 
-    /* Submit the duplicated stderr FD to Zsh */
-    addmodulefd( fileno( oconf->err ), FDT_MODULE );
+    /* Join and report finished workers */
+    char **reply = (char **) zshcalloc( ( count + 1 ) * sizeof( char * ) );
+    int r = 0;
+    for ( i = 0; i < count; i ++ ) {
+        struct worker *w = ws[ i ];
+        char line[ 128 ];
 
-    tries = 0;
+        if ( __atomic_load_n( &w->state, __ATOMIC_ACQUIRE ) == WORKER_RUNNING ) {
+            continue;
+        }
+        recycle_worker( w );
 
-    /* Prepare standard input replacement */
-    oconf->r_devnull = fopen( "/dev/null", "r");
-    /* Replace standard input with /dev/null */
-    // dup2( fileno( oconf->r_devnull ), STDIN_FILENO );
-    fclose( oconf->r_devnull );
-    oconf->r_devnull = NULL;
+        snprintf( line, sizeof( line ), "%d:%d:%ld:%s", ids[ i ], w->status, STAT_GET( w->stats.records ), w->error ? w->error : "" );
+        reply[ r ++ ] = ztrdup( line );
+        if ( w->status ) {
+            failed = 1;
+        }
+    }
+    setaparam( "reply", reply );
+
+    if ( timed_out ) {
+        return 2;
+    }
+    return failed ? 1 : 0;
+}
+
+/*
+ * Options:
+ * -n max - take at most `max' records
+ * -t timeout - seconds to wait at most for the first record
+ * -c - cancel the queue
+ */
+static int
+bin_zpread( char *name, char **argv, Options ops, int func )
+{
+    struct timespec deadline, *dl = NULL;
+    struct worker *w;
+    struct queue *q;
+    int max = 0, count = 0, size;
+    char **arr, *str;
 
-    oconf->silent = OPT_ISSET( ops, 's' );
-    oconf->only_global = OPT_ISSET( ops, 'g' );
-    oconf->debug = OPT_ISSET( ops, 'v' );
+    reap_retired();
 
-    /* Array targets */
-    if ( OPT_ISSET( ops, 'a' ) ) {
-       oconf->mode = OUTPUT_ARRAY;
-       oconf->target = ztrdup( OPT_ARG( ops, 'a' ) );
-    } else if ( OPT_ISSET( ops, 'A' ) ) {
-       oconf->mode = OUTPUT_HASH;
-       oconf->target = ztrdup( OPT_ARG( ops, 'A' ) );
+    if ( OPT_ISSET( ops, 'h' ) ) {
+        show_help_zpread();
+        return 0;
     }
 
-    /* Delimeters */
+    if ( OPT_ISSET( ops, 'c' ) ? ( ! argv[ 0 ] || argv[ 1 ] ) : ( ! argv[ 0 ] || ! argv[ 1 ] || argv[ 2 ] ) ) {
+        zwarnnam( name, OPT_ISSET( ops, 'c' ) ? "worker ID expected" : "worker ID and array name expected" );
+        return 1;
+    }
 
-    if ( OPT_ISSET( ops, 'd' ) ) {
-        zsfree( oconf->main_d );
-        oconf->main_d = ztrdup( OPT_ARG( ops, 'd' ) );
-        oconf->main_d_len = strlen( oconf->main_d );
+    if ( ! ( w = worker_by_name( argv[ 0 ] ) ) || ! ( q = w->queue ) ) {
+        zwarnnam( name, "no queue of worker: %s", argv[ 0 ] );
+        return 1;
     }
 
-    if ( OPT_ISSET( ops, 'D' ) ) {
-        zsfree( oconf->sub_d );
-        oconf->sub_d = ztrdup( OPT_ARG( ops, 'D' ) );
-        oconf->sub_d_len = strlen( oconf->sub_d );
+    /* Queued records are freed with the queue */
+    if ( OPT_ISSET( ops, 'c' ) ) {
+        queue_cancel( q );
+        queue_drain_fd( q );
+        recycle_worker( w );
+        return 0;
     }
 
-    /* Worker ID */
-    if ( *argv ) {
-        oconf->id = atoi( *argv );
-        oconf->id --;
-        if ( oconf->id >= WORKER_COUNT || oconf->id < 0 ) {
-            if ( ! oconf->silent ) {
-                fprintf( stderr, "Worker thread ID should be from 1 to %d, aborting\n", WORKER_COUNT );
-                fflush( stderr );
-            }
+    if ( OPT_ISSET( ops, 'n' ) ) {
+        max = atoi( OPT_ARG( ops, 'n' ) );
+        if ( max < 1 ) {
+            zwarnnam( name, "-n expects a positive number" );
             return 1;
         }
-    } else {
-        oconf->id = 0;
     }
 
-    oconf->target_pm = ensurethereishash( oconf->target, oconf );
-    if ( ! oconf->target_pm ) {
-        free_oconf( oconf );
-        return 1;
+    if ( OPT_ISSET( ops, 't' ) ) {
+        if ( ! set_deadline( &deadline, OPT_ARG( ops, 't' ) ) ) {
+            zwarnnam( name, "bad timeout: %s", OPT_ARG( ops, 't' ) );
+            return 1;
+        }
+        dl = &deadline;
     }
 
-    /* Mark the thread as working */
-    worker_finished[ oconf->id ][ 0 ] = '0';
+    size = max ? max : 64;
+    arr = (char **) zalloc( ( size + 1 ) * sizeof( char * ) );
 
-    /* Sum up the created worker thread */
-    workers_count ++;
+    while ( 1 ) {
+        /* Worker state is read before the ring, so that a
+         * finished worker's last records aren't missed */
+        int finished = __atomic_load_n( &w->state, __ATOMIC_ACQUIRE ) != WORKER_RUNNING;
+
+        queue_drain_fd( q );
+        while ( ( ! max || count < max ) && ( str = queue_pop( q ) ) ) {
+            if ( count == size ) {
+                size *= 2;
+                arr = (char **) zrealloc( arr, ( size + 1 ) * sizeof( char * ) );
+            }
+            arr[ count ++ ] = str;
+        }
 
-#if 0
-    char buf[10];
-    if ( ! fread( buf, 1, 4, oconf->stream ) ) {
-        fprintf( stderr, "-- fread also failed, in main thread, fileno: %d\n", fileno( oconf->stream ) );
-        fflush( stderr );
-    }
-#endif
+        if ( count || finished ) {
+            break;
+        }
 
-    pthread_cond_init( &oconf->cond, NULL );
-    pthread_mutex_init( &oconf->mutex, NULL );
-    pthread_mutex_lock( &oconf->mutex );
+        struct pollfd pfds[ 2 ];
+        pfds[ 0 ].fd = q->fd;
+        pfds[ 1 ].fd = w->fd;
+        pfds[ 0 ].events = pfds[ 1 ].events = POLLIN;
+        pfds[ 0 ].revents = pfds[ 1 ].revents = 0;
 
-    /* Run the thread */
-    if ( pthread_create( &workers[ oconf->id ], NULL, process_input, oconf ) ) {
-        if ( ! oconf->silent ) {
-            fprintf( stderr, "zpopulator: Error creating thread\n" );
-            fflush( stderr );
+        int ret = poll( pfds, 2, ms_left( dl ) );
+        if ( ret == 0 ) {
+            break;
+        }
+        if ( ret == -1 ) {
+            if ( errno == EINTR && ! errflag ) {
+                continue;
+            }
+            if ( errno != EINTR ) {
+                zwarnnam( name, "poll failed: %e", errno );
+            }
+            arr[ count ] = NULL;
+            freearray( arr );
+            return 1;
         }
+    }
 
-        free_oconf( oconf );
+    arr[ count ] = NULL;
+    setaparam( argv[ 1 ], arr );
 
-        return 1;
+    if ( count ) {
+        return 0;
     }
+    /* Empty ring of running worker means timeout */
+    return __atomic_load_n( &w->state, __ATOMIC_ACQUIRE ) == WORKER_RUNNING ? 2 : 1;
+}
 
-    pthread_cond_t *cond = &oconf->cond;
-    pthread_mutex_t *mutex = &oconf->mutex;
-
-    pthread_cond_wait( cond, mutex );
-    pthread_mutex_unlock( mutex );
-    pthread_mutex_destroy( mutex );
-    pthread_cond_destroy( cond );
+/* Prints stage timings of worker in slot `w', if it has them */
+static void
+print_stage_stats( int id, struct worker *w, double tick_ns ) {
+    static const char *names[ STAGES ] = { "read", "scan", "split", "lookup", "alloc", "move" };
+    struct workerstats *st = &w->stats;
+    int i;
 
-    return 0;
+    int64_t start = STAT_GET( st->start_ns );
+    if ( ! start || ! st->timed ) {
+        return;
+    }
+    int64_t end = STAT_GET( st->end_ns );
+    if ( ! end ) {
+        end = now_ns();
+    }
+    double elapsed_ms = ( end - start ) / 1e6;
+
+    printf( "worker %d: records=%ld elapsed=%.3f ms%s\n", id, STAT_GET( st->records ), elapsed_ms,
+            STAT_GET( st->end_ns ) ? "" : " (running)" );
+    printf( "  %-7s %12s %12s %10s %7s\n", "stage", "calls", "ms", "ns/call", "%" );
+    for ( i = 0; i < STAGES; i ++ ) {
+        long calls = STAT_GET( st->calls[ i ] );
+        double ms = STAT_GET( st->ticks[ i ] ) * tick_ns / 1e6;
+        printf( "  %-7s %12ld %12.3f %10.1f %7.1f\n", names[ i ], calls, ms,
+                calls ? ms * 1e6 / calls : 0.0, elapsed_ms > 0 ? 100.0 * ms / elapsed_ms : 0.0 );
+    }
 }
 
-/* this function is run by separate thread */
+static int
+bin_zpstats( char *name, char **argv, Options ops, int func )
+{
+    double tick_ns = ns_per_tick();
+    int i;
 
-static void *eval_it( void *void_ptr ) {
-    struct zpinconf *pconf = ( struct zpinconf * ) void_ptr;
-    fprintf( stderr, "[2] Zpin has stdout: %d\n", fileno( stdout ) );
-    fflush( stderr );
-    bin_eval( NULL, pconf->command, NULL, 0 );
-    fprintf( stderr, "[3] Zpin has stdout: %d\n", fileno( stdout ) );
-    fflush( stderr );
-    return NULL;
+    reap_retired();
+
+    if ( OPT_ISSET( ops, 'h' ) ) {
+        show_help_zpstats();
+        return 0;
+    }
+
+    if ( ! *argv ) {
+        for ( i = 0; i < workers_size; i ++ ) {
+            print_stage_stats( i + 1, workers[ i ], tick_ns );
+        }
+    }
+
+    for ( ; *argv; argv ++ ) {
+        struct worker *w = worker_by_name( *argv );
+        if ( ! w ) {
+            zwarnnam( name, "no such worker: %s", *argv );
+            return 1;
+        }
+        if ( ! w->stats.timed ) {
+            zwarnnam( name, "worker %s wasn't started with -T", *argv );
+            continue;
+        }
+        print_stage_stats( atoi( *argv ), w, tick_ns );
+    }
+
+    fflush( stdout );
+    return 0;
 }
 
 static int
 bin_zpin( char *name, char **argv, Options ops, int func )
 {
+    reap_retired();
+
     if ( OPT_ISSET( ops, 'h' ) ) {
         show_help_zpin();
         return 0;
@@ -732,13 +5011,18 @@ bin_zpin( char *name, char **argv, Options ops, int func )
  */
 
 static struct builtin bintab[] = {
-    BUILTIN("zpopulator", 0, bin_zpopulator, 0, -1, 0, "a:A:x:d:D:hsgv", NULL),
+    BUILTIN("zpopulator", 0, bin_zpopulator, 0, -1, 0, "a:A:xq:f:c:u:M:F:J:j:lLIb:d:D:n:i:hpsgvT", NULL),
     BUILTIN("zpin", 0, bin_zpin, 0, -1, 0, "h", NULL),
+    BUILTIN("zpwait", 0, bin_zpwait, 0, -1, 0, "t:aoh", NULL),
+    BUILTIN("zpread", 0, bin_zpread, 0, -1, 0, "n:t:ch", NULL),
+    BUILTIN("zpstats", 0, bin_zpstats, 0, -1, 0, "h", NULL),
 };
 
 static struct paramdef patab[] = {
     ROINTPARAMDEF( "zpworkers_count", &workers_count ),
     ROARRPARAMDEF( "zpworker_finished", &worker_finished ),
+    ROARRPARAMDEF( "zpworker_fd", &worker_fd ),
+    SPECIALPMDEF( "zpworker_stats", PM_READONLY, NULL, getpmworkerstats, scanpmworkerstats ),
 };
 
 static struct features module_features = {
@@ -775,13 +5059,15 @@ enables_(Module m, int **enables)
 int
 boot_(Module m)
 {
-    worker_finished = zshcalloc( ( WORKER_COUNT + 1 ) * sizeof( char * ) );
+    select_find_byte();
 
-    for ( int i = 0 ; i < WORKER_COUNT; i ++ ) {
-        worker_finished[ i ] = ztrdup( "1" );
-    }
+    /* Reference point of ns_per_tick() */
+    boot_ns = now_ns();
+    boot_ticks = zp_ticks();
 
-    worker_finished[ WORKER_COUNT ] = NULL;
+    /* Empty registry, slots are added when needed */
+    worker_finished = zshcalloc( sizeof( char * ) );
+    worker_fd = zshcalloc( sizeof( char * ) );
 
     return 0;
 }
@@ -790,6 +5076,47 @@ boot_(Module m)
 int
 cleanup_(Module m)
 {
+    int i, running = 0;
+
+    /* Running thread would execute unmapped code. Only
+     * -q workers are stopped - they can be waiting for
+     * zpread that will never come */
+    for ( i = 0; i < workers_size; i ++ ) {
+        if ( __atomic_load_n( &workers[ i ]->state, __ATOMIC_ACQUIRE ) == WORKER_RUNNING && ! workers[ i ]->queue ) {
+            running ++;
+        }
+    }
+    if ( running ) {
+        zwarn( "zpopulator: %d worker(s) still running, not unloading; see zpwait", running );
+        return 1;
+    }
+
+    /* Join threads that have finished, dropping records
+     * that nobody read; woken -q worker is given a second
+     * to end, it can be blocked on input */
+    for ( i = 0; i < workers_size; i ++ ) {
+        struct worker *w = workers[ i ];
+        if ( w->queue ) {
+            queue_cancel( w->queue );
+            if ( __atomic_load_n( &w->state, __ATOMIC_ACQUIRE ) == WORKER_RUNNING ) {
+                struct pollfd pfd;
+                pfd.fd = w->fd;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                poll( &pfd, 1, 1000 );
+            }
+        }
+        recycle_worker( w );
+        if ( w->state == WORKER_RUNNING ) {
+            running ++;
+        }
+    }
+    if ( running ) {
+        zwarn( "zpopulator: %d worker(s) with cancelled queue still running, not unloading", running );
+        return 1;
+    }
+
+    reap_retired();
     return setfeatureenables(m, &module_features, NULL);
 }
 
@@ -797,6 +5124,11 @@ cleanup_(Module m)
 int
 finish_(UNUSED(Module m))
 {
+    /* cleanup_() has refused already, this is a backstop */
+    if ( __atomic_load_n( &workers_count, __ATOMIC_RELAXED ) ) {
+        return 1;
+    }
+
     printf( "zpopulator unloaded, bye.\n" );
     fflush( stdout );
     return 0;
@@ -806,33 +5138,52 @@ finish_(UNUSED(Module m))
 /* Repeated hash functions with thread-safety amendments             */
 /*********************************************************************/
 
+/* Creates struct zptable, see zptable_* functions */
 static HashTable my_newparamtable(int size, char const *name)
 {
     HashTable ht;
-    if (!size)
-	size = 17;
-    ht = my_newhashtable(size, name, NULL);
+    struct zptable *zt;
+    int level = 16;
 
-    ht->hash        = hasher;
-    ht->emptytable  = my_emptyhashtable;
+    /* Linear hashing needs a power of two */
+    while (level < size && level < EXPECTED_MAX)
+	level *= 2;
+
+    ht = my_allochashtable(sizeof(struct zptable), level * 2, name, NULL);
+    if (!ht)
+	return NULL;
+    zt = (struct zptable *) ht;
+    arena_init(&zt->arena);
+    ht->hsize = zt->level = level;
+    zt->split = 0;
+    zt->cap = level * 2;
+
+    ht->hash        = zp_hash;
+    ht->emptytable  = zptable_emptytable;
     ht->filltable   = NULL;
     ht->cmpnodes    = strcmp;
-    ht->addnode     = my_addhashnode;
+    ht->addnode     = zptable_addnode;
     ht->getnode     = my_getparamnode;
     ht->getnode2    = my_gethashnode2;
-    ht->removenode  = my_removehashnode;
+    ht->removenode  = zptable_removenode;
     ht->disablenode = NULL;
     ht->enablenode  = NULL;
-    ht->freenode    = my_freeparamnode;
+    ht->freenode    = zptable_freenode;
     ht->printnode   = printparamnode;      /* safe, and used only after this module's computation */
 
     return ht;
 }
 
 static HashTable my_newhashtable(int size, UNUSED(char const *name), UNUSED(PrintTableStats printinfo)) {
+    return my_allochashtable(sizeof(struct hashtable), size, name, printinfo);
+}
+
+static HashTable my_allochashtable(size_t tabsize, int size, UNUSED(char const *name), UNUSED(PrintTableStats printinfo)) {
     HashTable ht;
 
-    ht = (HashTable) my_zshcalloc(sizeof *ht);
+    ht = (HashTable) my_zshcalloc(tabsize);
+    if (!ht)
+	return NULL;
 #ifdef ZSH_HASH_DEBUG
     ht->next = NULL;
     if(!firstht)
@@ -899,15 +5250,19 @@ static HashNode my_addhashnode2(HashTable ht, char *nam, void *nodeptr) {
     hn = (HashNode) nodeptr;
     hn->nam = nam;
 
-    hashval = ht->hash(hn->nam) % ht->hsize;
+    hashval = my_hashindex(ht, ht->hash(hn->nam));
     hp = ht->nodes[hashval];
 
     /* check if this is the first node for this hash value */
     if (!hp) {
 	hn->next = NULL;
 	ht->nodes[hashval] = hn;
-	if (++ht->ct >= ht->hsize * 2 && !ht->scan)
-	    my_expandhashtable(ht);
+	if (++ht->ct >= ht->hsize * 2 && !ht->scan) {
+	    if (is_zptable(ht))
+		zptable_grow((struct zptable *) ht);
+	    else
+		my_expandhashtable(ht);
+	}
 	return NULL;
     }
 
@@ -942,8 +5297,12 @@ static HashNode my_addhashnode2(HashTable ht, char *nam, void *nodeptr) {
     /* else just add it at the front of the list */
     hn->next = ht->nodes[hashval];
     ht->nodes[hashval] = hn;
-    if (++ht->ct >= ht->hsize * 2 && !ht->scan)
-        my_expandhashtable(ht);
+    if (++ht->ct >= ht->hsize * 2 && !ht->scan) {
+	if (is_zptable(ht))
+	    zptable_grow((struct zptable *) ht);
+	else
+	    my_expandhashtable(ht);
+    }
     return NULL;
 }
 
@@ -963,7 +5322,7 @@ static void my_expandhashtable(HashTable ht) {
     for (i = 0, ha = onodes; i < osize; i++, ha++) {
 	for (hn = *ha; hn;) {
 	    hp = hn->next;
-	    ht->addnode(ht, hn->nam, hn);
+	    my_addhashnode2(ht, hn->nam, hn);
 	    hn = hp;
 	}
     }
@@ -988,7 +5347,10 @@ static HashNode my_gethashnode2(HashTable ht, const char *nam) {
     unsigned hashval;
     HashNode hp;
 
-    hashval = ht->hash(nam) % ht->hsize;
+    if (is_zptable(ht))
+	return (HashNode) zptable_lookup((struct zptable *) ht, nam, ht->hash(nam));
+
+    hashval = my_hashindex(ht, ht->hash(nam));
     for (hp = ht->nodes[hashval]; hp; hp = hp->next) {
 	if (ht->cmpnodes(hp->nam, nam) == 0)
 	    return hp;
@@ -1002,7 +5364,7 @@ static HashNode my_removehashnode(HashTable ht, const char *nam) {
     unsigned hashval;
     HashNode hp, hq;
 
-    hashval = ht->hash(nam) % ht->hsize;
+    hashval = my_hashindex(ht, ht->hash(nam));
     hp = ht->nodes[hashval];
 
     /* if no nodes at this hash value, return NULL */
@@ -1119,6 +5481,7 @@ static void * my_zalloc(size_t size)
     if (!size)
 	size = 1;
 
+    COUNT_ALLOC();
     if (!(ptr = (void *) malloc(size))) {
 	fputs( "zpopulator: fatal error: out of memory", stderr );
         fflush( stderr );
@@ -1175,6 +5538,403 @@ static char * my_ztrdup(const char *s) {
     return t;
 }
 
+/*********************************************************************/
+/* Arena allocator                                                   */
+/*********************************************************************/
+
+#define ARENA_MIN_CHUNK ( 64 * 1024 )
+#define ARENA_MAX_CHUNK ( 8 * 1024 * 1024 )
+
+static void arena_init(struct arena *a) {
+    a->chunks = NULL;
+    a->next_size = ARENA_MIN_CHUNK;
+    a->bytes = 0;
+}
+
+/* Chunk's usable memory follows its header */
+static char *arena_chunk_data(struct arenachunk *c) {
+    return (char *) (c + 1);
+}
+
+static void *arena_alloc(struct arena *a, size_t size, size_t align) {
+    struct arenachunk *c = a->chunks;
+    size_t off;
+
+    if (c) {
+	off = (c->used + align - 1) & ~(align - 1);
+	if (off + size <= c->size) {
+	    c->used = off + size;
+	    return arena_chunk_data(c) + off;
+	}
+    }
+
+    /* Big requests get a chunk of their own, behind the
+     * current one, which stays open for small requests */
+    if (size > a->next_size / 4) {
+	struct arenachunk *big = (struct arenachunk *) my_zalloc(sizeof(struct arenachunk) + size);
+	if (!big)
+	    return NULL;
+	big->size = big->used = size;
+	a->bytes += size;
+	if (c) {
+	    big->next = c->next;
+	    c->next = big;
+	} else {
+	    big->next = NULL;
+	    a->chunks = big;
+	}
+	return arena_chunk_data(big);
+    }
+
+    c = (struct arenachunk *) my_zalloc(sizeof(struct arenachunk) + a->next_size);
+    if (!c)
+	return NULL;
+    c->size = a->next_size;
+    c->used = size;
+    c->next = a->chunks;
+    a->chunks = c;
+    a->bytes += c->size;
+
+    if (a->next_size < ARENA_MAX_CHUNK)
+	a->next_size *= 2;
+
+    return arena_chunk_data(c);
+}
+
+static void arena_release(struct arena *a) {
+    struct arenachunk *c, *next;
+
+    for (c = a->chunks; c; c = next) {
+	next = c->next;
+	my_zfree(c, sizeof(struct arenachunk) + c->size);
+    }
+    arena_init(a);
+}
+
+/* Moves src's chunks to dst, behind dst's current chunk,
+ * which stays open for allocations */
+static void arena_adopt(struct arena *dst, struct arena *src) {
+    struct arenachunk *last;
+
+    if (!src->chunks)
+	return;
+
+    for (last = src->chunks; last->next; last = last->next)
+	;
+    if (dst->chunks) {
+	last->next = dst->chunks->next;
+	dst->chunks->next = src->chunks;
+    } else {
+	dst->chunks = src->chunks;
+	dst->next_size = src->next_size;
+    }
+    dst->bytes += src->bytes;
+    arena_init(src);
+}
+
+static char *arena_metafy_dup(struct arena *a, const char *s, int len) {
+    char *t = (char *) arena_alloc(a, metafied_len(s, len) + 1, 1);
+    if (t)
+	metafy_copy(t, s, len);
+    return t;
+}
+
+/*********************************************************************/
+/* Arena-backed hash tables (struct zptable)                         */
+/*********************************************************************/
+
+/* Hash function of zptables - takes 8 bytes per step,
+ * so long keys with common prefix (paths) are cheap */
+static unsigned zp_memhash(const char *s, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len, w;
+
+    while (len >= 8) {
+	memcpy(&w, s, 8);
+	h = (h ^ w) * 0xff51afd7ed558ccdULL;
+	h ^= h >> 32;
+	s += 8;
+	len -= 8;
+    }
+    if (len) {
+	w = 0;
+	memcpy(&w, s, len);
+	h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    }
+
+    /* Final mix - bucket index uses the low bits */
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (unsigned) h;
+}
+
+static unsigned zp_hash(const char *str) {
+    return zp_memhash(str, strlen(str));
+}
+
+static int is_zptable(HashTable ht) {
+    return ht->emptytable == zptable_emptytable;
+}
+
+/* Worker's node with value in the arena; the old value
+ * is not freed, shell's new value is on the heap */
+static void zptable_strsetfn(Param pm, char *x) {
+    pm->u.str = x;
+    if (x) {
+	pm->gsu.s = &zptable_heapval_gsu;
+	((struct zpparam *) pm)->table->heapvals++;
+    }
+}
+
+/* Takes already metafied key */
+static struct zpparam *zptable_newnode(struct zptable *zt, const char *mkey, int mkey_len, unsigned hashval, const char *value, int value_len) {
+    struct zpparam *node;
+
+    node = (struct zpparam *) arena_alloc(&zt->arena, sizeof(struct zpparam), sizeof(void *));
+    if (!node)
+	return NULL;
+    memset(node, 0, sizeof(struct zpparam));
+
+    node->pm.node.flags = PM_SCALAR | PM_HASHELEM;
+    node->pm.gsu.s = &zptable_scalar_gsu;
+    node->table = zt;
+    node->hashval = hashval;
+
+    /* NULL `value' is set by caller, see zptable_setlazy() */
+    node->pm.node.nam = (char *) arena_alloc(&zt->arena, mkey_len + 1, 1);
+    if (value)
+	node->pm.u.str = arena_metafy_dup(&zt->arena, value, value_len);
+    if (!node->pm.node.nam || (value && !node->pm.u.str))
+	return NULL;
+    memcpy(node->pm.node.nam, mkey, mkey_len + 1);
+
+    return node;
+}
+
+/* Hash of node, stored when worker created it */
+static unsigned zptable_nodehash(HashTable ht, HashNode hn) {
+    if (ZPNODE_P((Param) hn))
+	return ((struct zpparam *) hn)->hashval;
+    return ht->hash(hn->nam);
+}
+
+static struct zpparam *zptable_lookup(struct zptable *zt, const char *nam, unsigned hashval) {
+    HashNode hp;
+
+    for (hp = zt->ht.nodes[my_hashindex(&zt->ht, hashval)]; hp; hp = hp->next) {
+	if (ZPNODE_P((Param) hp) && ((struct zpparam *) hp)->hashval != hashval)
+	    continue;
+	if (strcmp(hp->nam, nam) == 0)
+	    return (struct zpparam *) hp;
+    }
+    return NULL;
+}
+
+/* Adds worker's node, whose key isn't in the table */
+static void zptable_insert(struct zptable *zt, struct zpparam *node) {
+    HashTable ht = &zt->ht;
+    HashNode *bucket = &ht->nodes[my_hashindex(ht, node->hashval)];
+
+    node->pm.node.next = *bucket;
+    *bucket = &node->pm.node;
+    if (++ht->ct >= ht->hsize * 2 && !ht->scan)
+	zptable_grow(zt);
+}
+
+/* Worker's update of a key it has already stored. The
+ * previous arena value stays allocated until release */
+static void zptable_setvalue(struct zpparam *node, const char *value, int value_len) {
+    char *str = arena_metafy_dup(&node->table->arena, value, value_len);
+    if (str)
+	zptable_setstr(node, str);
+}
+
+/* Sets value that is in the table's arena */
+static void zptable_setstr(struct zpparam *node, char *str) {
+    if (node->pm.gsu.s == &zptable_heapval_gsu)
+	my_zsfree(node->pm.u.str);
+    node->pm.gsu.s = &zptable_scalar_gsu;
+    node->pm.u.str = str;
+}
+
+/* Sets value that stays in input mapping until read */
+static void zptable_setlazy(struct zpparam *node, const char *value, int value_len, int cache) {
+    if (node->pm.gsu.s == &zptable_heapval_gsu)
+	my_zsfree(node->pm.u.str);
+    node->pm.gsu.s = cache ? &zptable_lazy_gsu : &zptable_lazync_gsu;
+    node->pm.u.str = (char *) value;
+    node->vlen = value_len;
+}
+
+/* Makes mapping live as long as the table's nodes */
+static void zptable_addmap(struct zptable *zt, void *data, size_t len) {
+    struct zpmap *m = (struct zpmap *) my_zalloc(sizeof(struct zpmap));
+    if (!m)
+	return;
+    m->data = data;
+    m->len = len;
+    m->next = zt->maps;
+    zt->maps = m;
+}
+
+/* Bucket of given hash value, in zptable or other table */
+static unsigned my_hashindex(HashTable ht, unsigned hashval) {
+    if (is_zptable(ht)) {
+	struct zptable *zt = (struct zptable *) ht;
+	unsigned idx = hashval & (zt->level - 1);
+	if (idx < (unsigned) zt->split)
+	    idx = hashval & (2 * zt->level - 1);
+	return idx;
+    }
+    return hashval % ht->hsize;
+}
+
+/* Number of buckets divided per insert above load limit */
+#define ZPTABLE_SPLITS 2
+
+/* Grows table by a few buckets, instead of rehashing all
+ * nodes at once: each split bucket's nodes are divided
+ * between it and one new bucket at the end of nodes[] */
+static void zptable_grow(struct zptable *zt) {
+    HashTable ht = &zt->ht;
+    HashNode hn, hp, *lo, *hi;
+    int i;
+
+    for (i = 0; i < ZPTABLE_SPLITS && ht->ct >= ht->hsize * 2; i++) {
+	if (ht->hsize == zt->cap) {
+	    /* All buckets of this level are in use, allocate
+	     * for the next level - only pointers are copied */
+	    HashNode *nodes = (HashNode *) my_zshcalloc(zt->cap * 2 * sizeof(HashNode));
+	    if (!nodes)
+		return;
+	    memcpy(nodes, ht->nodes, ht->hsize * sizeof(HashNode));
+	    retire(ht->nodes, retired_free);
+	    __atomic_store_n(&ht->nodes, nodes, __ATOMIC_RELEASE);
+	    zt->cap *= 2;
+	}
+
+	lo = &ht->nodes[zt->split];
+	hi = &ht->nodes[zt->split + zt->level];
+	hn = *lo;
+	*lo = NULL;
+	for (; hn; hn = hp) {
+	    hp = hn->next;
+	    if (zptable_nodehash(ht, hn) & zt->level) {
+		hn->next = *hi;
+		*hi = hn;
+	    } else {
+		hn->next = *lo;
+		*lo = hn;
+	    }
+	}
+
+	ht->hsize++;
+	if (++zt->split == zt->level) {
+	    zt->level *= 2;
+	    zt->split = 0;
+	}
+    }
+}
+
+/* Used by shell only - worker adds its nodes directly */
+static void zptable_addnode(HashTable ht, char *nam, void *nodeptr) {
+    if (!ZPNODE_P((Param) nodeptr))
+	((struct zptable *) ht)->foreign++;
+    my_addhashnode(ht, nam, nodeptr);
+}
+
+static HashNode zptable_removenode(HashTable ht, const char *nam) {
+    HashNode hn = my_removehashnode(ht, nam);
+    if (hn && !ZPNODE_P((Param) hn))
+	((struct zptable *) ht)->foreign--;
+    return hn;
+}
+
+static void zptable_freenode(HashNode hn) {
+    Param pm = (Param) hn;
+
+    if (!ZPNODE_P(pm)) {
+	my_freeparamnode(hn);
+	return;
+    }
+
+    /* Frees value only if it's on the heap; the node
+     * itself and its name are in the arena */
+    pm->gsu.s->unsetfn(pm, 1);
+}
+
+/* Without shell's nodes and values, the table is just
+ * forgotten and arena chunks released */
+static void zptable_emptytable(HashTable ht) {
+    struct zptable *zt = (struct zptable *) ht;
+    HashNode hn, hp;
+    int i;
+
+    if (zt->foreign || zt->heapvals) {
+	for (i = 0; i < ht->hsize; i++) {
+	    for (hn = ht->nodes[i]; hn;) {
+		hp = hn->next;
+		ht->freenode(hn);
+		hn = hp;
+	    }
+	}
+    }
+
+    memset(ht->nodes, 0, ht->hsize * sizeof(HashNode));
+    ht->ct = 0;
+    zt->foreign = 0;
+    zt->heapvals = 0;
+    arena_release(&zt->arena);
+
+    while (zt->maps) {
+	struct zpmap *m = zt->maps;
+	zt->maps = m->next;
+	munmap(m->data, m->len);
+	my_zfree(m, sizeof(struct zpmap));
+    }
+}
+
+/* Frees table used only by worker */
+static void zptable_delete(HashTable ht) {
+    ht->emptytable(ht);
+    my_zfree(ht->nodes, ((struct zptable *) ht)->cap * sizeof(HashNode));
+    my_zfree(ht, sizeof(struct zptable));
+}
+
+/* Moves all nodes of worker's table `src' into `dst',
+ * replacing values of keys that are already there; src's
+ * arena chunks become dst's, nothing is copied */
+static void zptable_merge(struct zptable *dst, struct zptable *src) {
+    HashNode hn, next;
+    int i;
+
+    arena_adopt(&dst->arena, &src->arena);
+
+    for (i = 0; i < src->ht.hsize; i++) {
+	for (hn = src->ht.nodes[i]; hn; hn = next) {
+	    struct zpparam *node = (struct zpparam *) hn, *old;
+	    next = hn->next;
+
+	    old = zptable_lookup(dst, hn->nam, node->hashval);
+	    if (!old) {
+		node->table = dst;
+		zptable_insert(dst, node);
+	    } else if (ZPNODE_P(&old->pm)) {
+		if (ZPLAZY_P(&node->pm))
+		    zptable_setlazy(old, node->pm.u.str, node->vlen, node->pm.gsu.s == &zptable_lazy_gsu);
+		else
+		    zptable_setstr(old, node->pm.u.str);
+	    } else if (ZPLAZY_P(&node->pm)) {
+		my_strsetfn(&old->pm, my_metafy_dup(node->pm.u.str, node->vlen));
+	    } else {
+		my_strsetfn(&old->pm, my_ztrdup(node->pm.u.str));
+	    }
+	}
+	src->ht.nodes[i] = NULL;
+    }
+    src->ht.ct = 0;
+}
+
 /*********************************************************************/
 /* Thread safe setters and getters, although they can be used only   */
 /* within computation thread, because they don't queue signals, etc. */
@@ -1183,6 +5943,36 @@ static char * my_ztrdup(const char *s) {
 
 static const struct gsu_scalar my_stdscalar_gsu = { my_strgetfn, my_strsetfn, my_stdunsetfn };
 
+/* For nodes of struct zptable, see ZPNODE_P() */
+static const struct gsu_scalar zptable_scalar_gsu = { my_strgetfn, zptable_strsetfn, my_stdunsetfn };
+static const struct gsu_scalar zptable_heapval_gsu = { my_strgetfn, my_strsetfn, my_stdunsetfn };
+static const struct gsu_scalar zptable_lazy_gsu = { zptable_lazygetfn, zptable_strsetfn, my_stdunsetfn };
+static const struct gsu_scalar zptable_lazync_gsu = { zptable_lazyncgetfn, zptable_strsetfn, my_stdunsetfn };
+
+/* Called by shell - value is materialized when first
+ * read and kept, the node becomes a heap value one */
+static char * zptable_lazygetfn(Param pm) {
+    struct zpparam *node = (struct zpparam *) pm;
+    char *str = my_metafy_dup(pm->u.str, node->vlen);
+
+    if (!str)
+	return (char *) "";
+    pm->u.str = str;
+    pm->gsu.s = &zptable_heapval_gsu;
+    node->table->heapvals++;
+    return str;
+}
+
+/* Called by shell - value is materialized on every
+ * read, on the heap of current expansion */
+static char * zptable_lazyncgetfn(Param pm) {
+    struct zpparam *node = (struct zpparam *) pm;
+    char *str = (char *) zhalloc(metafied_len(pm->u.str, node->vlen) + 1);
+
+    metafy_copy(str, pm->u.str, node->vlen);
+    return str;
+}
+
 static void my_assigngetset(Param pm) {
     switch (PM_TYPE(pm->node.flags)) {
     case PM_SCALAR: